@@ -36,6 +36,7 @@
 #include <libdce.h>
 #include <sched.h>
 #include <math.h>
+#include <poll.h>
 
 #ifndef MIN
 #define MIN(a,b)     (((a) < (b)) ? (a) : (b))
@@ -74,6 +75,141 @@ gst_vpe_get_type (void)
 }
 
 
+#define GST_TYPE_VPE_MEMORY_MODE (gst_vpe_memory_mode_get_type ())
+static GType
+gst_vpe_memory_mode_get_type (void)
+{
+  static GType memory_mode_type = 0;
+
+  if (!memory_mode_type) {
+    static const GEnumValue memory_modes[] = {
+      {GST_VPE_MEMORY_MODE_DMABUF,
+          "Import omap dmabufs on both queues", "dmabuf"},
+      {GST_VPE_MEMORY_MODE_MMAP,
+          "Driver allocated buffers exported as dmabufs, input is copied",
+          "mmap"},
+      {GST_VPE_MEMORY_MODE_USERPTR,
+            "Page aligned system memory input, driver allocated output",
+          "userptr"},
+      {0, NULL, NULL},
+    };
+    memory_mode_type = g_enum_register_static ("GstVpeMemoryMode",
+        memory_modes);
+  }
+  return memory_mode_type;
+}
+
+#define GST_TYPE_VPE_DROP_POLICY (gst_vpe_drop_policy_get_type ())
+static GType
+gst_vpe_drop_policy_get_type (void)
+{
+  static GType drop_policy_type = 0;
+
+  if (!drop_policy_type) {
+    static const GEnumValue drop_policies[] = {
+      {GST_VPE_DROP_NONE, "Hold back every frame", "none"},
+      {GST_VPE_DROP_OLDEST, "Drop the oldest frames held back",
+          "drop-oldest"},
+      {GST_VPE_DROP_NEWEST, "Drop the incoming frames", "drop-newest"},
+      {GST_VPE_DROP_KEEP_NTH, "Keep every Nth incoming frame",
+          "keep-every-nth"},
+      {0, NULL, NULL},
+    };
+    drop_policy_type = g_enum_register_static ("GstVpeDropPolicy",
+        drop_policies);
+  }
+  return drop_policy_type;
+}
+
+GType
+gst_vpe_latency_mode_get_type (void)
+{
+  static GType latency_mode_type = 0;
+
+  if (!latency_mode_type) {
+    static const GEnumValue latency_modes[] = {
+      {GST_VPE_LATENCY_NORMAL, "Keep the device busy", "normal"},
+      {GST_VPE_LATENCY_LOW,
+          "One frame at a time, pushed from the streaming thread", "low"},
+      {0, NULL, NULL},
+    };
+    latency_mode_type = g_enum_register_static ("GstVpeLatencyMode",
+        latency_modes);
+  }
+  return latency_mode_type;
+}
+
+#define GST_TYPE_VPE_TASK_POLICY (gst_vpe_task_policy_get_type ())
+static GType
+gst_vpe_task_policy_get_type (void)
+{
+  static GType task_policy_type = 0;
+
+  if (!task_policy_type) {
+    static const GEnumValue task_policies[] = {
+      {GST_VPE_TASK_POLICY_FIFO, "SCHED_FIFO", "fifo"},
+      {GST_VPE_TASK_POLICY_RR, "SCHED_RR", "rr"},
+      {0, NULL, NULL},
+    };
+    task_policy_type = g_enum_register_static ("GstVpeTaskPolicy",
+        task_policies);
+  }
+  return task_policy_type;
+}
+
+#define GST_TYPE_VPE_FENCE_MODE (gst_vpe_fence_mode_get_type ())
+static GType
+gst_vpe_fence_mode_get_type (void)
+{
+  static GType fence_mode_type = 0;
+
+  if (!fence_mode_type) {
+    static const GEnumValue fence_modes[] = {
+      {GST_VPE_FENCE_NONE, "No fences", "none"},
+      {GST_VPE_FENCE_WAIT, "Wait for the fences of the input before queueing",
+          "wait"},
+      {GST_VPE_FENCE_EARLY,
+          "Also push the output at QBUF time, with a completion fence, to "
+          "downstream that asks for the fence meta", "early"},
+      {0, NULL, NULL},
+    };
+    fence_mode_type = g_enum_register_static ("GstVpeFenceMode", fence_modes);
+  }
+  return fence_mode_type;
+}
+
+#define GST_TYPE_VPE_ALLOCATOR (gst_vpe_allocator_get_type ())
+static GType
+gst_vpe_allocator_get_type (void)
+{
+  static GType allocator_type = 0;
+
+  if (!allocator_type) {
+    static const GEnumValue allocators[] = {
+      {GST_VPE_ALLOCATOR_OMAP_DRM, "omap DRM buffers", "omap-drm"},
+      {GST_VPE_ALLOCATOR_DMA_HEAP, "System dma-heap", "dma-heap"},
+      {GST_VPE_ALLOCATOR_UDMABUF, "memfd backed udmabuf", "udmabuf"},
+      {0, NULL, NULL},
+    };
+    allocator_type = g_enum_register_static ("GstVpeAllocator", allocators);
+  }
+  return allocator_type;
+}
+
+/* V4L2 memory type of the OUTPUT (input == TRUE) or CAPTURE queue */
+static guint32
+gst_vpe_v4l2_memory (GstVpe * self, gboolean input)
+{
+  switch (self->memory_mode) {
+    case GST_VPE_MEMORY_MODE_MMAP:
+      return V4L2_MEMORY_MMAP;
+    case GST_VPE_MEMORY_MODE_USERPTR:
+      return input ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    default:
+      return V4L2_MEMORY_DMABUF;
+  }
+}
+
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
@@ -94,15 +230,67 @@ enum
   PROP_0,
   PROP_NUM_INPUT_BUFFERS,
   PROP_NUM_OUTPUT_BUFFERS,
-  PROP_DEVICE
+  PROP_DEVICE,
+  PROP_ADD_BORDERS,
+  PROP_STATS,
+  PROP_MEMORY_MODE,
+  PROP_ALLOCATOR,
+  PROP_MEMORY_BUDGET,
+  PROP_MEMORY_USAGE,
+  PROP_DEVICE_GRACE_PERIOD,
+  PROP_PREWARM,
+  PROP_DEVICE_POOL,
+  PROP_PRIORITY,
+  PROP_TARGET_FRAMERATE,
+  PROP_DROP_POLICY,
+  PROP_KEEP_EVERY,
+  PROP_TRICKMODE_SCALE,
+  PROP_REVERSE_REORDER,
+  PROP_LATENCY_MODE,
+  PROP_INPUT_QUEUE_DEPTH,
+  PROP_TASK_PRIORITY,
+  PROP_TASK_POLICY,
+  PROP_CPU_AFFINITY,
+  PROP_FENCE_MODE,
+  PROP_ASYNC_TEARDOWN
 };
 
 
+#define MIN_NUM_OUTBUFS   3
 #define MAX_NUM_OUTBUFS   16
 #define MAX_NUM_INBUFS    128
-#define DEFAULT_NUM_OUTBUFS   6
+#define DEFAULT_NUM_OUTBUFS   0
 #define DEFAULT_NUM_INBUFS    12
 #define DEFAULT_DEVICE        "/dev/v4l/by-path/platform-489d0000.vpe-video-index0"
+#define DEFAULT_ADD_BORDERS   FALSE
+#define DEFAULT_MEMORY_MODE   GST_VPE_MEMORY_MODE_DMABUF
+#define DEFAULT_ALLOCATOR     GST_VPE_ALLOCATOR_OMAP_DRM
+#define DEFAULT_MEMORY_BUDGET 0
+#define DEFAULT_DEVICE_GRACE_PERIOD 2000
+#define DEFAULT_PREWARM       FALSE
+#define DEFAULT_DEVICE_POOL   NULL
+#define DEFAULT_PRIORITY      0
+#define DEFAULT_DROP_POLICY   GST_VPE_DROP_NONE
+#define DEFAULT_KEEP_EVERY    2
+#define DEFAULT_TRICKMODE_SCALE 1
+#define DEFAULT_REVERSE_REORDER TRUE
+#define DEFAULT_LATENCY_MODE  GST_VPE_LATENCY_NORMAL
+#define DEFAULT_INPUT_QUEUE_DEPTH 0
+#define DEFAULT_TASK_PRIORITY 0
+#define DEFAULT_TASK_POLICY   GST_VPE_TASK_POLICY_FIFO
+#define DEFAULT_CPU_AFFINITY  0
+#define DEFAULT_FENCE_MODE    GST_VPE_FENCE_NONE
+#define DEFAULT_ASYNC_TEARDOWN TRUE
+
+/* How long the streaming thread waits for its frame in low latency mode */
+#define LOW_LATENCY_TIMEOUT   100       /* ms */
+
+/* How long renegotiation waits for the frames the driver holds */
+#define DRAIN_TIMEOUT         1000      /* ms */
+
+/* Scaling limits of the VPE */
+#define VPE_MIN_SIZE          16
+#define VPE_MAX_SIZE          2048
 
 static gboolean
 gst_vpe_parse_input_caps (GstVpe * self, GstCaps * input_caps)
@@ -165,16 +353,126 @@ gst_vpe_parse_input_caps (GstVpe * self, GstCaps * input_caps)
   return TRUE;
 }
 
+/* RGB has no fourcc in GStreamer, it is tracked by its video format */
+static guint32
+gst_vpe_format_to_fourcc (const gchar * fmt)
+{
+  if (!g_strcmp0 (fmt, "RGB"))
+    return GST_VIDEO_FORMAT_RGB;
+  return GST_STR_FOURCC (fmt);
+}
+
+/* Collect the formats of the pad template into a list */
+static void
+gst_vpe_template_formats (GstPad * pad, GValue * formats)
+{
+  GstCaps *templ = gst_pad_get_pad_template_caps (pad);
+  GValue v = G_VALUE_INIT;
+  const gchar *fmt;
+  guint i;
+
+  g_value_init (formats, GST_TYPE_LIST);
+  for (i = 0; i < gst_caps_get_size (templ); i++) {
+    fmt = gst_structure_get_string (gst_caps_get_structure (templ, i),
+        "format");
+    if (!fmt)
+      continue;
+    g_value_init (&v, G_TYPE_STRING);
+    g_value_set_string (&v, fmt);
+    gst_value_list_append_value (formats, &v);
+    g_value_unset (&v);
+  }
+  gst_caps_unref (templ);
+}
+
+/* Whether the frames of an input caps structure need deinterlacing */
+static gboolean
+gst_vpe_structure_interlaced (const GstStructure * s)
+{
+  gboolean interlaced = FALSE;
+  const gchar *mode;
+
+  gst_structure_get_boolean (s, "interlaced", &interlaced);
+  mode = gst_structure_get_string (s, "interlace-mode");
+  return interlaced || (mode && g_strcmp0 (mode, "progressive"));
+}
+
+/* Transform caps on the pad with the given direction into the caps the
+ * other pad can produce or accept for them. The result is ordered by
+ * processing cost, so that negotiation picks the cheapest path:
+ *  - the unchanged caps (passthrough), unless the input has to be
+ *    deinterlaced or cropped
+ *  - the same geometry in any format of the other pad (color conversion)
+ *  - any format and any size within the VPE limits (scaling)
+ */
+static GstCaps *
+gst_vpe_transform_caps (GstVpe * self, GstPadDirection direction,
+    GstCaps * caps)
+{
+  GstPad *otherpad = (direction == GST_PAD_SINK) ? self->srcpad :
+      self->sinkpad;
+  GstCaps *passthrough, *csc, *scale, *templ, *ret;
+  GstStructure *st;
+  GValue formats = G_VALUE_INIT;
+  guint i;
+
+  if (gst_caps_is_any (caps))
+    return gst_pad_get_pad_template_caps (otherpad);
+
+  gst_vpe_template_formats (otherpad, &formats);
+  passthrough = gst_caps_new_empty ();
+  csc = gst_caps_new_empty ();
+  scale = gst_caps_new_empty ();
+
+  for (i = 0; i < gst_caps_get_size (caps); i++) {
+    st = gst_structure_copy (gst_caps_get_structure (caps, i));
+    if (direction == GST_PAD_SRC || !(self->interlaced ||
+            self->input_crop.c.width || gst_vpe_structure_interlaced (st)))
+      gst_caps_append_structure (passthrough, gst_structure_copy (st));
+
+    /* Whatever the input, the VPE outputs progressive frames, of the
+     * cropped size once it is known */
+    if (direction == GST_PAD_SINK) {
+      gst_structure_remove_fields (st, "interlaced", "interlace-mode",
+          "max-ref-frames", NULL);
+      if (self->input_crop.c.width && self->interlaced)
+        gst_structure_set (st, "width", G_TYPE_INT, self->input_crop.c.width,
+            "height", G_TYPE_INT, self->input_crop.c.height * 2, NULL);
+    }
+    gst_structure_set_value (st, "format", &formats);
+    gst_caps_append_structure (csc, gst_structure_copy (st));
+
+    gst_structure_set (st,
+        "width", GST_TYPE_INT_RANGE, VPE_MIN_SIZE, VPE_MAX_SIZE,
+        "height", GST_TYPE_INT_RANGE, VPE_MIN_SIZE, VPE_MAX_SIZE, NULL);
+    gst_structure_remove_field (st, "pixel-aspect-ratio");
+    gst_caps_append_structure (scale, st);
+  }
+  g_value_unset (&formats);
+
+  ret = gst_caps_merge (passthrough, csc);
+  ret = gst_caps_merge (ret, scale);
+
+  templ = gst_pad_get_pad_template_caps (otherpad);
+  caps = gst_caps_intersect_full (ret, templ, GST_CAPS_INTERSECT_FIRST);
+  gst_caps_unref (templ);
+  gst_caps_unref (ret);
+  return caps;
+}
+
 static gboolean
 gst_vpe_set_output_caps (GstVpe * self)
 {
   printf
       ("gstvpe.c:gst_vpe_set_output_caps: entered gst_vpe_set_output_caps\n");
-  GstCaps *outcaps;
+  GstCaps *outcaps, *candidates, *peercaps;
   GstStructure *s, *out_s;
+  GValue formats = G_VALUE_INIT;
   gint fps_n, fps_d;
   gint par_width, par_height;
+  gint width, height;
   const gchar *fmt = NULL;
+  gchar *out_fmt;
 
   if (!self->input_caps)
     return FALSE;
@@ -184,60 +482,103 @@ gst_vpe_set_output_caps (GstVpe * self)
 
   s = gst_caps_get_structure (self->input_caps, 0);
 
-  outcaps = gst_pad_get_allowed_caps (self->srcpad);
-  if (outcaps && !(self->output_caps
-          && gst_caps_is_strictly_equal (outcaps, self->output_caps))) {
-    GST_DEBUG_OBJECT (self, "Downstream allowed caps: %s",
-        gst_caps_to_string (outcaps));
-    out_s = gst_caps_get_structure (outcaps, 0);
-    fmt = gst_structure_get_string (out_s, "format");
+  if (self->input_crop.c.width && self->interlaced) {
+    /* Ducati decoder had the habit of setting height as half frame hight for
+     * interlaced streams */
+    height = (self->interlaced) ? self->input_crop.c.height *
+        2 : self->input_crop.c.height;
+    width = self->input_crop.c.width;
+  } else {
+    height = self->input_height;
+    width = self->input_width;
+  }
+  if ((self->trickmode || self->reverse) && self->trickmode_scale > 1) {
+    /* Smaller frames are cheaper for us and for downstream, if it takes
+     * them */
+    width = MAX (GST_ROUND_DOWN_2 (width / self->trickmode_scale),
+        VPE_MIN_SIZE);
+    height = MAX (GST_ROUND_DOWN_2 (height / self->trickmode_scale),
+        VPE_MIN_SIZE);
+  }
 
-    if (out_s &&
-        gst_structure_get_int (out_s, "width", &self->output_width) &&
-        gst_structure_get_int (out_s, "height", &self->output_height) && fmt) {
-      self->output_fourcc = GST_STR_FOURCC (fmt);
-      GST_DEBUG_OBJECT (self, "Using downstream caps, fixed_caps = TRUE");
-      self->fixed_caps = TRUE;
-      self->output_framerate_d = self->output_framerate_n = 0;
-      if (gst_structure_get_fraction (out_s, "framerate", &fps_n, &fps_d)) {
-        self->output_framerate_d = fps_d;
-        self->output_framerate_n = fps_n;
-      }
-    }
+  /* Let downstream choose among what we can produce from the input caps.
+   * The size aimed for goes first, in any format, as fixating cannot
+   * change a size the structures further down already fix. Then the
+   * candidates, ordered cheapest first */
+  out_s = gst_structure_copy (s);
+  gst_structure_remove_fields (out_s, "interlaced", "interlace-mode",
+      "max-ref-frames", NULL);
+  gst_vpe_template_formats (self->srcpad, &formats);
+  gst_structure_set_value (out_s, "format", &formats);
+  g_value_unset (&formats);
+  gst_structure_set (out_s, "width", G_TYPE_INT, width,
+      "height", G_TYPE_INT, height, NULL);
+  candidates = gst_caps_new_full (out_s, NULL);
+  candidates = gst_caps_merge (candidates,
+      gst_vpe_transform_caps (self, GST_PAD_SINK, self->input_caps));
+  peercaps = gst_pad_peer_query_caps (self->srcpad, candidates);
+  outcaps = gst_caps_intersect_full (candidates, peercaps,
+      GST_CAPS_INTERSECT_FIRST);
+  gst_caps_unref (candidates);
+  GST_DEBUG_OBJECT (self, "Downstream allowed caps: %" GST_PTR_FORMAT,
+      outcaps);
+
+  if (gst_caps_is_empty (outcaps)) {
+    GST_ERROR_OBJECT (self, "No output caps acceptable to downstream");
+    gst_caps_unref (peercaps);
+    gst_caps_unref (outcaps);
+    return FALSE;
   }
 
-  if (!self->fixed_caps) {
-    printf ("gstvpe.c:gst_vpe_set_output_caps: if(!self->fixed_caps)\n");
-    if (self->input_crop.c.width && self->interlaced) {
-      /* Ducati decoder had the habit of setting height as half frame hight for
-       * interlaced streams */
-      self->output_height =
-          (self->interlaced) ? self->input_crop.c.height *
-          2 : self->input_crop.c.height;
-      self->output_width = self->input_crop.c.width;
-    } else {
-      self->output_height = self->input_height;
-      self->output_width = self->input_width;
+  /* Downstream caps are binding only when it refuses the stream as is,
+   * otherwise the output keeps following the input (crop, interlacing) */
+  self->fixed_caps = !gst_caps_can_intersect (peercaps, self->input_caps);
+  gst_caps_unref (peercaps);
+  GST_DEBUG_OBJECT (self, "fixed_caps = %s",
+      self->fixed_caps ? "TRUE" : "FALSE");
+
+  out_s = gst_structure_copy (gst_caps_get_structure (outcaps, 0));
+  gst_caps_unref (outcaps);
+
+  gst_structure_fixate_field_nearest_int (out_s, "width", width);
+  gst_structure_fixate_field_nearest_int (out_s, "height", height);
+  fmt = gst_structure_get_string (s, "format");
+  if (fmt && gst_structure_has_field (out_s, "format"))
+    gst_structure_fixate_field_string (out_s, "format", fmt);
+
+  if (!gst_structure_get_int (out_s, "width", &self->output_width))
+    self->output_width = width;
+  if (!gst_structure_get_int (out_s, "height", &self->output_height))
+    self->output_height = height;
+  if (gst_structure_get_string (out_s, "format"))
+    fmt = gst_structure_get_string (out_s, "format");
+  out_fmt = g_strdup (fmt);
+  self->output_fourcc = gst_vpe_format_to_fourcc (out_fmt);
+
+  self->output_par_n = self->output_par_d = 1;
+  self->output_framerate_d = self->output_framerate_n = 0;
+  if (self->fixed_caps) {
+    gst_structure_get_fraction (out_s, "pixel-aspect-ratio",
+        &self->output_par_n, &self->output_par_d);
+    if (gst_structure_get_fraction (out_s, "framerate", &fps_n, &fps_d)) {
+      self->output_framerate_d = fps_d;
+      self->output_framerate_n = fps_n;
     }
-    //self->output_fourcc = GST_MAKE_FOURCC ('N', 'V', '1', '2');
-    self->output_fourcc = GST_VIDEO_FORMAT_RGB;
   }
+  gst_structure_free (out_s);
+
   self->passthrough = !(self->interlaced ||
       self->output_width != self->input_width ||
       self->output_height != self->input_height ||
       self->output_fourcc != self->input_fourcc);
 
-  GST_DEBUG_OBJECT (self, "Passthrough = %s",
+  GST_DEBUG_OBJECT (self, "Output: %s %dx%d, Passthrough = %s", out_fmt,
+      self->output_width, self->output_height,
       self->passthrough ? "TRUE" : "FALSE");
 
-  gst_caps_unref (outcaps);
-
-  outcaps = gst_caps_new_simple ("video/x-raw", "format", G_TYPE_STRING, "RGB", NULL);  //this forces it to be RGB?
-  //outcaps = gst_caps_new_simple ("video/x-raw", "format", G_TYPE_STRING, gst_video_format_to_string (self->output_fourcc), NULL); //first modified implementation.
-  /*  outcaps = gst_caps_new_simple ("video/x-raw",
-     "format", G_TYPE_STRING,
-     gst_video_format_to_string
-     (gst_video_format_from_fourcc (self->output_fourcc)), NULL); *///original implementation
+  outcaps = gst_caps_new_simple ("video/x-raw",
+      "format", G_TYPE_STRING, out_fmt, NULL);
+  g_free (out_fmt);
 
   out_s = gst_caps_get_structure (outcaps, 0);
 
@@ -245,10 +586,25 @@ gst_vpe_set_output_caps (GstVpe * self)
       "width", G_TYPE_INT, self->output_width,
       "height", G_TYPE_INT, self->output_height, NULL);
 
+  self->input_par_n = self->input_par_d = 1;
   if (gst_structure_get_fraction (s, "pixel-aspect-ratio",
-          &par_width, &par_height))
+          &par_width, &par_height)) {
+    self->input_par_n = par_width;
+    self->input_par_d = par_height;
+    if (!self->add_borders)
+      gst_structure_set (out_s, "pixel-aspect-ratio", GST_TYPE_FRACTION,
+          par_width, par_height, NULL);
+  }
+  if (self->add_borders) {
+    /* The picture is boxed into the output frame, so the output keeps
+     * the pixel-aspect-ratio of the downstream caps */
+    if (!self->fixed_caps) {
+      self->output_par_n = self->input_par_n;
+      self->output_par_d = self->input_par_d;
+    }
     gst_structure_set (out_s, "pixel-aspect-ratio", GST_TYPE_FRACTION,
-        par_width, par_height, NULL);
+        self->output_par_n, self->output_par_d, NULL);
+  }
 
   self->input_framerate_d = self->input_framerate_n = 0;
   if (gst_structure_get_fraction (s, "framerate", &fps_n, &fps_d)) {
@@ -284,10 +640,245 @@ gst_vpe_set_output_caps (GstVpe * self)
   return TRUE;
 }
 
+/* Work out the capture compose rectangle: with add-borders set, the
+ * (cropped) input is scaled into the largest centered rectangle of the
+ * output frame that keeps its display aspect ratio.
+ */
+static void
+gst_vpe_calculate_compose (GstVpe * self)
+{
+  gint in_w, in_h, w, h;
+  guint64 dar_n, dar_d;
+
+  self->output_compose.left = 0;
+  self->output_compose.top = 0;
+  self->output_compose.width = self->output_width;
+  self->output_compose.height = self->output_height;
+
+  if (!self->add_borders)
+    return;
+
+  if (self->input_crop.c.width) {
+    in_w = self->input_crop.c.width;
+    in_h = (self->interlaced) ? self->input_crop.c.height *
+        2 : self->input_crop.c.height;
+  } else {
+    in_w = self->input_width;
+    in_h = self->input_height;
+  }
+  if (in_w <= 0 || in_h <= 0 || self->output_width <= 0
+      || self->output_height <= 0 || self->output_par_n <= 0
+      || self->input_par_d <= 0)
+    return;
+
+  dar_n = (guint64) in_w * self->input_par_n * self->output_par_d;
+  dar_d = (guint64) in_h * self->input_par_d * self->output_par_n;
+
+  /* Try filling the output height first (pillarbox), else fill the
+   * width (letterbox) */
+  w = (gint) gst_util_uint64_scale (self->output_height, dar_n, dar_d);
+  if (w <= self->output_width) {
+    h = self->output_height;
+  } else {
+    w = self->output_width;
+    h = (gint) gst_util_uint64_scale (self->output_width, dar_d, dar_n);
+  }
+  /* Keep the rectangle aligned on chroma boundaries */
+  w &= ~1;
+  h &= ~1;
+  if (w <= 0 || h <= 0)
+    return;
+
+  self->output_compose.width = w;
+  self->output_compose.height = h;
+  self->output_compose.left = ((self->output_width - w) / 2) & ~1;
+  self->output_compose.top = ((self->output_height - h) / 2) & ~1;
+
+  GST_DEBUG_OBJECT (self, "Compose rectangle: %dx%d at (%d, %d) in %dx%d",
+      w, h, self->output_compose.left, self->output_compose.top,
+      self->output_width, self->output_height);
+}
+
+static gboolean
+gst_vpe_has_borders (GstVpe * self)
+{
+  return (self->add_borders &&
+      (self->output_compose.width != self->output_width ||
+          self->output_compose.height != self->output_height));
+}
+
+/* Paint a whole output buffer black */
+static void
+gst_vpe_fill_black (GstVpe * self, GstBuffer * buf)
+{
+  GstMapInfo map;
+  gsize i, luma;
+  guint stride = self->output_format.fmt.pix_mp.plane_fmt[0].bytesperline;
+
+  if (!gst_buffer_map (buf, &map, GST_MAP_WRITE)) {
+    GST_WARNING_OBJECT (self, "Cannot map output buffer to paint borders");
+    return;
+  }
+  if (stride == 0)
+    stride = self->output_width;
+
+  switch (self->output_fourcc) {
+    case GST_MAKE_FOURCC ('N', 'V', '1', '2'):
+      luma = MIN (map.size, (gsize) stride * self->output_height);
+      memset (map.data, 0x10, luma);
+      memset (map.data + luma, 0x80, map.size - luma);
+      break;
+    case GST_MAKE_FOURCC ('Y', 'U', 'Y', '2'):
+    case GST_MAKE_FOURCC ('Y', 'U', 'Y', 'V'):
+      for (i = 0; i + 1 < map.size; i += 2) {
+        map.data[i] = 0x10;
+        map.data[i + 1] = 0x80;
+      }
+      break;
+    default:
+      memset (map.data, 0, map.size);
+      break;
+  }
+  gst_buffer_unmap (buf, &map);
+}
+
+static void
+gst_vpe_release_downstream_pool (GstVpe * self)
+{
+  if (self->downstream_pool) {
+    gst_buffer_pool_set_active (self->downstream_pool, FALSE);
+    gst_object_unref (self->downstream_pool);
+    self->downstream_pool = NULL;
+  }
+}
+
+/* Number of CAPTURE buffers to allocate. Unless it is set, this is what
+ * the driver works on plus what downstream holds, from its allocation
+ * answer and from the time it was seen to keep each buffer. Called with
+ * the state lock.
+ */
+static gint
+gst_vpe_num_output_buffers (GstVpe * self)
+{
+  GstClockTime hold = self->output_pool ? self->output_pool->hold_time :
+      self->output_hold_time;
+  guint64 held = 0;
+
+  if (self->latency_mode == GST_VPE_LATENCY_LOW)
+    return MIN_NUM_OUTBUFS;
+  if (self->num_output_buffers)
+    return self->num_output_buffers;
+  if (hold && self->output_framerate_n > 0 && self->output_framerate_d > 0)
+    held = gst_util_uint64_scale_ceil (hold, self->output_framerate_n,
+        GST_SECOND * self->output_framerate_d);
+  held = MAX (MAX (held, self->downstream_min), 1);
+  return CLAMP ((gint) MIN (held, MAX_NUM_OUTBUFS) + MIN_NUM_OUTBUFS - 1,
+      MIN_NUM_OUTBUFS, MAX_NUM_OUTBUFS);
+}
+
+/* Ask downstream whether it wants the VPE to render into its own buffers,
+ * e.g. scanout or encoder memory. Must be called without the state lock,
+ * after the output caps are set.
+ */
+static void
+gst_vpe_decide_allocation (GstVpe * self)
+{
+  GstQuery *query;
+  GstBufferPool *pool = NULL;
+  GstStructure *config;
+  GstCaps *caps;
+  guint size = 0, min = 0, max = 0;
+  gint num_output_buffers;
+  gboolean import, fences = FALSE;
+
+  GST_VPE_STATE_LOCK (self);
+  gst_vpe_release_downstream_pool (self);
+  self->downstream_fences = FALSE;
+  caps = (self->output_caps && !self->passthrough) ?
+      gst_caps_ref (self->output_caps) : NULL;
+  /* Driver allocated output buffers cannot be replaced */
+  import = self->memory_mode == GST_VPE_MEMORY_MODE_DMABUF;
+  GST_VPE_STATE_UNLOCK (self);
+  if (!caps)
+    return;
+
+  query = gst_query_new_allocation (caps, TRUE);
+  if (!gst_pad_peer_query (self->srcpad, query)) {
+    GST_DEBUG_OBJECT (self, "Downstream did not answer the allocation query");
+  } else {
+    if (gst_query_get_n_allocation_pools (query) > 0)
+      gst_query_parse_nth_allocation_pool (query, 0, &pool, &size, &min,
+          &max);
+    /* Only then may the frames go out before the VPE wrote them */
+    fences = gst_query_find_allocation_meta (query,
+        GST_VPE_FENCE_META_API_TYPE, NULL);
+  }
+  gst_query_unref (query);
+
+  GST_VPE_STATE_LOCK (self);
+  self->downstream_min = min;
+  self->downstream_fences = fences;
+  if (self->fence_mode == GST_VPE_FENCE_EARLY && !fences)
+    GST_DEBUG_OBJECT (self, "Downstream does not wait for fences, pushing "
+        "output once processed");
+  num_output_buffers = gst_vpe_num_output_buffers (self);
+  GST_VPE_STATE_UNLOCK (self);
+  GST_DEBUG_OBJECT (self, "Downstream needs %d buffers, using %d", min,
+      num_output_buffers);
+
+  if (pool && !import) {
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+  if (pool && max != 0 && max < num_output_buffers) {
+    GST_DEBUG_OBJECT (self, "Downstream pool has only %d buffers", max);
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+  if (pool) {
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, caps, size,
+        MAX (min, num_output_buffers), max);
+    if (!gst_buffer_pool_set_config (pool, config) ||
+        !gst_buffer_pool_set_active (pool, TRUE)) {
+      GST_DEBUG_OBJECT (self, "Cannot configure the downstream pool");
+      gst_object_unref (pool);
+      pool = NULL;
+    }
+  }
+  gst_caps_unref (caps);
+
+  if (pool) {
+    GST_DEBUG_OBJECT (self, "Using downstream pool %" GST_PTR_FORMAT, pool);
+    GST_VPE_STATE_LOCK (self);
+    self->downstream_pool = pool;
+    GST_VPE_STATE_UNLOCK (self);
+  }
+}
+
+/* Get a CAPTURE buffer that wraps a buffer of the downstream pool */
+static GstBuffer *
+gst_vpe_downstream_buffer (GstVpe * self, gint index)
+{
+  GstBufferPoolAcquireParams params = {
+    .flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT,
+  };
+  GstBuffer *dbuf = NULL, *buf;
+
+  if (gst_buffer_pool_acquire_buffer (self->downstream_pool, &dbuf,
+          &params) != GST_FLOW_OK)
+    return NULL;
+  buf = gst_vpe_buffer_wrap (self->output_pool, self->dev,
+      self->output_fourcc, self->output_width, self->output_height,
+      index, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, dbuf);
+  gst_buffer_unref (dbuf);
+  return buf;
+}
+
 static gboolean
 gst_vpe_init_output_buffers (GstVpe * self)
 {
-  int i;
+  int i, num_output_buffers = gst_vpe_num_output_buffers (self);
   GstBuffer *buf;
   if (!self->output_caps) {
     GST_DEBUG_OBJECT (self,
@@ -295,24 +886,60 @@ gst_vpe_init_output_buffers (GstVpe * self)
     return FALSE;
   }
   self->output_pool =
-      gst_vpe_buffer_pool_new (TRUE, self->num_output_buffers,
-      self->num_output_buffers, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+      gst_vpe_buffer_pool_new (TRUE, num_output_buffers,
+      num_output_buffers, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
       self->output_caps, NULL, NULL);
   if (!self->output_pool) {
     return FALSE;
   }
 
   self->output_pool->format = &self->output_format;
+  self->output_pool->allocator = self->allocator;
+  self->output_pool->memory = gst_vpe_v4l2_memory (self, FALSE);
+  if (self->output_pool->memory == V4L2_MEMORY_MMAP &&
+      !gst_vpe_buffer_pool_request_buffers (self->output_pool,
+          self->video_fd, num_output_buffers)) {
+    return FALSE;
+  }
 
-  for (i = 0; i < self->num_output_buffers; i++) {
-    buf = gst_vpe_buffer_new (self->output_pool, self->dev,
-        self->output_fourcc,
-        self->output_width, self->output_height,
-        i, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+  for (i = 0; i < num_output_buffers; i++) {
+    buf = NULL;
+    /* The VPE cannot run with less, the other buffers have to fit in the
+     * memory budget */
+    self->output_pool->overcommit = (i < MIN_NUM_OUTBUFS);
+    if (self->output_pool->memory == V4L2_MEMORY_MMAP) {
+      buf = gst_vpe_buffer_export (self->output_pool, self->dev,
+          self->output_fourcc, self->output_width, self->output_height,
+          i, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+      if (!buf)
+        return FALSE;
+    } else if (self->downstream_pool) {
+      buf = gst_vpe_downstream_buffer (self, i);
+      if (!buf) {
+        GST_DEBUG_OBJECT (self, "Cannot import downstream buffers, "
+            "allocating our own");
+        gst_vpe_release_downstream_pool (self);
+      }
+    }
+    if (!buf)
+      buf = gst_vpe_buffer_new (self->output_pool, self->dev,
+          self->output_fourcc,
+          self->output_width, self->output_height,
+          i, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    if (!buf && i >= MIN_NUM_OUTBUFS) {
+      GST_WARNING_OBJECT (self, "Memory budget exhausted, using %d output "
+          "buffers instead of %d", i, num_output_buffers);
+      break;
+    }
     if (!buf) {
       return FALSE;
     }
 
+    /* The VPE only writes the compose rectangle, the borders are painted
+     * once here and survive the recycling of the buffer by the pool */
+    if (gst_vpe_has_borders (self))
+      gst_vpe_fill_black (self, buf);
+
     gst_vpe_buffer_pool_put (self->output_pool, buf);
     /* gst_vpe_buffer_pool_put keeps a reference of the buffer,
      * so, unref ours 
@@ -369,14 +996,54 @@ gst_vpe_output_set_fmt (GstVpe * self)
     /* Save a copy of the current format for this pool */
     self->output_format = fmt;
   }
+
+  gst_vpe_calculate_compose (self);
+  if (gst_vpe_has_borders (self)) {
+    struct v4l2_selection sel = {
+      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+      .target = V4L2_SEL_TGT_COMPOSE,
+    };
+    sel.r = self->output_compose;
+    ret = ioctl (self->video_fd, VIDIOC_S_SELECTION, &sel);
+    if (ret < 0) {
+      GST_WARNING_OBJECT (self,
+          "VIDIOC_S_SELECTION for compose failed, scaling to full frame");
+      self->output_compose.left = 0;
+      self->output_compose.top = 0;
+      self->output_compose.width = self->output_width;
+      self->output_compose.height = self->output_height;
+    }
+  }
   return TRUE;
 }
 
+/* The input memory layout is taken from the first buffer: NV12 with a
+ * separate chroma plane is set up as NV12M, and strides come from
+ * GstVideoMeta when upstream provides it.
+ */
+static void
+gst_vpe_set_input_layout (GstVpe * self, GstBuffer * buf)
+{
+  GstVideoMeta *meta = gst_buffer_get_video_meta (buf);
+
+  self->input_num_planes = gst_vpe_buffer_num_planes (self->input_fourcc,
+      self->input_height, buf);
+  self->input_stride[0] = meta ? meta->stride[0] : 0;
+  self->input_stride[1] = (meta && meta->n_planes > 1) ? meta->stride[1] : 0;
+  GST_DEBUG_OBJECT (self, "Input layout: %d planes, strides %d/%d",
+      self->input_num_planes, self->input_stride[0], self->input_stride[1]);
+}
+
 static GstBuffer *
 gst_vpe_alloc_inputbuffer (void *ctx, int index)
 {
   GstVpe *self = (GstVpe *) ctx;
 
+  if (self->input_pool->memory == V4L2_MEMORY_MMAP)
+    return gst_vpe_buffer_export (self->input_pool, self->dev,
+        self->input_fourcc,
+        self->input_width, self->input_height, index,
+        V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
   return gst_vpe_buffer_new (self->input_pool, self->dev,
       self->input_fourcc,
       self->input_width, self->input_height, index,
@@ -404,6 +1071,8 @@ gst_vpe_init_input_buffers (GstVpe * self, gint min_num_input_buffers)
   }
 
   self->input_pool->format = &self->input_format;
+  self->input_pool->allocator = self->allocator;
+  self->input_pool->memory = gst_vpe_v4l2_memory (self, TRUE);
   return TRUE;
 }
 
@@ -426,7 +1095,16 @@ gst_vpe_input_set_fmt (GstVpe * self)
   fmt.fmt.pix_mp.width = self->input_width;
   fmt.fmt.pix_mp.pixelformat =
       gst_vpe_fourcc_to_pixelformat (self->input_fourcc);
-  if (self->interlaced) {
+  /* In trick mode, the top field is processed as a progressive frame
+   * scaled to the output height, skipping the motion adaptive
+   * deinterlacer. This needs the chroma of the top field to be addressed
+   * on its own, so only with two planes. */
+  self->deinterlace = self->interlaced && !(self->trickmode &&
+      self->input_num_planes == 2);
+  if (self->interlaced && !self->deinterlace) {
+    fmt.fmt.pix_mp.height = self->input_height / 2;
+    fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+  } else if (self->interlaced) {
     printf ("gstvpe.c:gst_vpe_input_set_fmt: if(self->interlaced)\n");
     fmt.fmt.pix_mp.height = (self->input_height);
     fmt.fmt.pix_mp.field = V4L2_FIELD_SEQ_TB;
@@ -435,17 +1113,26 @@ gst_vpe_input_set_fmt (GstVpe * self)
     fmt.fmt.pix_mp.height = self->input_height;
     fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
   }
-  fmt.fmt.pix_mp.num_planes = 1;
+  fmt.fmt.pix_mp.num_planes = self->input_num_planes;
+  if (self->input_num_planes == 2)
+    fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12M;
+  fmt.fmt.pix_mp.plane_fmt[0].bytesperline = self->input_stride[0];
+  fmt.fmt.pix_mp.plane_fmt[1].bytesperline = self->input_stride[1];
 
   GST_DEBUG_OBJECT (self,
-      "input S_FMT field: %d, image: %dx%d, numbufs: %d",
+      "input S_FMT field: %d, image: %dx%d, planes: %d, numbufs: %d",
       fmt.fmt.pix_mp.field, fmt.fmt.pix_mp.width,
-      fmt.fmt.pix_mp.height, self->num_input_buffers);
+      fmt.fmt.pix_mp.height, fmt.fmt.pix_mp.num_planes,
+      self->num_input_buffers);
   ret = ioctl (self->video_fd, VIDIOC_S_FMT, &fmt);
   if (ret < 0) {
     GST_ERROR_OBJECT (self, "VIDIOC_S_FMT failed");
     return FALSE;
   } else {
+    if (self->input_stride[0] &&
+        fmt.fmt.pix_mp.plane_fmt[0].bytesperline != self->input_stride[0])
+      GST_WARNING_OBJECT (self, "Driver changed input stride %d to %d",
+          self->input_stride[0], fmt.fmt.pix_mp.plane_fmt[0].bytesperline);
     GST_DEBUG_OBJECT (self, "sizeimage[0] = %d, sizeimage[1] = %d",
         fmt.fmt.pix_mp.plane_fmt[0].sizeimage,
         fmt.fmt.pix_mp.plane_fmt[1].sizeimage);
@@ -480,56 +1167,734 @@ gst_vpe_input_set_fmt (GstVpe * self)
   return TRUE;
 }
 
+/* Whether buf can be pushed into the driver now: there has to be room in
+ * the input queue, the scheduler has to let us go, and the frame has to
+ * fit in the memory budget. An instance that has nothing
+ * queued goes over the budget rather than stalling. Called with the
+ * state lock.
+ */
+static gboolean
+gst_vpe_can_queue_input (GstVpe * self, GstBuffer * buf)
+{
+  gint max_depth = self->input_queue_depth ? self->input_queue_depth :
+      self->input_q_max;
+
+  /* In low latency mode, only the frame being processed is in the driver,
+   * and the previous one the deinterlacer needs */
+  if (self->latency_mode == GST_VPE_LATENCY_LOW)
+    max_depth = self->deinterlace ? 2 : 1;
+  if ((max_depth - self->input_q_depth) < 1)
+    return FALSE;
+  if (self->node && !gst_vpe_node_may_queue (self->node, self,
+          self->input_q_depth))
+    return FALSE;
+  if (!gst_vpe_buffer_pool_reserve (self->input_pool, buf,
+          self->input_q_depth == 0)) {
+    if (!self->over_budget) {
+      GST_DEBUG_OBJECT (self, "Memory budget exhausted, holding back input");
+      GST_OBJECT_LOCK (self);
+      self->over_budget = TRUE;
+      GST_OBJECT_UNLOCK (self);
+    }
+    return FALSE;
+  }
+  if (self->over_budget) {
+    GST_OBJECT_LOCK (self);
+    self->over_budget = FALSE;
+    GST_OBJECT_UNLOCK (self);
+  }
+  return TRUE;
+}
 
+/* In auto mode, adjust the input queue depth once per AUTO_DEPTH_WINDOW
+ * frames: grow it while it holds back input and the device still runs
+ * dry, shrink it while it is not reached. Called with the state lock.
+ */
 static void
-gst_vpe_dequeue_loop (gpointer data)
+gst_vpe_auto_depth (GstVpe * self)
 {
-  GstVpe *self = (GstVpe *) data;
-  GstBuffer *buf, *b;
-  gint q_cnt;
-  while (1) {
-    buf = NULL;
+  gint min = self->deinterlace ? MIN_INPUT_Q_DEPTH + 1 : MIN_INPUT_Q_DEPTH;
+  gint old = self->input_q_max, depth = old;
+
+  self->auto_peak = MAX (self->auto_peak, self->input_q_depth);
+  if (++self->auto_frames < AUTO_DEPTH_WINDOW)
+    return;
+  if (self->auto_waits && self->auto_idle)
+    depth++;
+  else if (self->auto_peak < depth)
+    depth--;
+  depth = CLAMP (depth, min, MAX_INPUT_Q_DEPTH);
+  if (depth != old) {
+    GST_DEBUG_OBJECT (self, "Input queue depth %d -> %d (waits %d, idle %d, "
+        "peak %d)", old, depth, self->auto_waits, self->auto_idle,
+        self->auto_peak);
     GST_OBJECT_LOCK (self);
-    if (self->video_fd >= 0 && self->output_pool)
-      (void)
-          gst_buffer_pool_acquire_buffer (GST_BUFFER_POOL (self->output_pool),
-          &buf, NULL);
-    if (buf) {
-      self->output_q_processing--;
-      g_assert (self->output_q_processing >= 0);
-    }
+    self->input_q_max = depth;
     GST_OBJECT_UNLOCK (self);
-    if (buf) {
-      for (q_cnt = 1; q_cnt < self->output_repeat_rate; q_cnt++) {
-        b = gst_vpe_buffer_ref (self->output_pool, buf);
-        if (b)
-          gst_pad_push (self->srcpad, GST_BUFFER (b));
-      }
-      GST_DEBUG_OBJECT (self, "push: %" GST_TIME_FORMAT " (ptr %p)",
-          GST_TIME_ARGS (GST_BUFFER_PTS (buf)), buf);
-      gst_pad_push (self->srcpad, GST_BUFFER (buf));
-    } else
+  }
+  self->auto_frames = self->auto_waits = self->auto_idle = 0;
+  self->auto_peak = 0;
+}
+
+/* Tell the scheduler how busy our node is. Called with the state lock. */
+static void
+gst_vpe_node_report (GstVpe * self, GstClockTime frame_time)
+{
+  if (self->node)
+    gst_vpe_node_update (self->node, self, self->output_q_processing,
+        frame_time);
+}
+
+/* Account an input frame queued q_cnt times into the driver. Called with
+ * the state lock.
+ */
+static void
+gst_vpe_input_queued (GstVpe * self, gint q_cnt)
+{
+  /* The driver starts working for us, time the frame from here */
+  if (q_cnt && self->output_q_processing == 0) {
+    self->last_output_time = gst_util_get_timestamp ();
+    if (self->frames_queued)
+      self->auto_idle++;
+  }
+  if (self->node)
+    gst_vpe_node_queued (self->node, self);
+  if (q_cnt)
+    self->qbuf_time[self->frames_queued++ % LATENCY_RING] =
+        gst_util_get_timestamp ();
+  self->input_q_depth += q_cnt;
+  if (q_cnt && self->input_queue_depth == 0)
+    gst_vpe_auto_depth (self);
+  if (self->deinterlace) {
+    self->output_q_processing += q_cnt * 2;
+  } else {
+    self->output_q_processing += q_cnt;
+  }
+  gst_vpe_node_report (self, GST_CLOCK_TIME_NONE);
+}
+
+/* With early output, hand out the output buffer the frame just queued is
+ * going to be written to, with a fence the dequeue loop signals once it
+ * is. Only if downstream said it waits for the fence meta, and while
+ * every frame in flight went out that way, so that the output stays in
+ * order. Called with the state lock, before the frame is accounted.
+ */
+static void
+gst_vpe_queue_early (GstVpe * self, GstClockTime pts, GstClockTime duration)
+{
+  GstVpeFenceMeta *meta;
+  GstVpeFence *fence;
+  GstBuffer *buf;
+
+  if (self->fence_mode != GST_VPE_FENCE_EARLY || !self->downstream_fences ||
+      !self->output_pool || self->deinterlace || self->reverse || self->output_repeat_rate != 1 ||
+      self->early_in_flight != self->output_q_processing)
+    return;
+  buf = gst_vpe_buffer_pool_peek_queued (self->output_pool,
+      self->output_q_processing);
+  if (!buf || !gst_buffer_is_writable (buf))
+    return;
+  if (!(fence = gst_vpe_fence_new ()))
+    return;
+  /* A fence left from a stream off was signalled already */
+  meta = gst_buffer_get_vpe_fence_meta (buf);
+  if (meta)
+    gst_buffer_remove_meta (buf, (GstMeta *) meta);
+  gst_buffer_add_vpe_fence_meta (buf, fence);
+  gst_vpe_fence_unref (fence);
+  GST_BUFFER_PTS (buf) = pts;
+  GST_BUFFER_DURATION (buf) = duration;
+  g_queue_push_tail (&self->early_q, gst_buffer_ref (buf));
+  self->early_in_flight++;
+  GST_OBJECT_LOCK (self);
+  self->early_frames++;
+  GST_OBJECT_UNLOCK (self);
+}
+
+/* Called with the state lock */
+static gboolean
+gst_vpe_queue_input (GstVpe * self, GstBuffer * buf)
+{
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  GstClockTime duration = GST_BUFFER_DURATION (buf);
+  gint q_cnt;
+
+  if (TRUE != gst_vpe_buffer_pool_queue (self->input_pool, buf, &q_cnt))
+    return FALSE;
+  if (q_cnt)
+    gst_vpe_queue_early (self, pts, duration);
+  gst_vpe_input_queued (self, q_cnt);
+  return TRUE;
+}
+
+/* Take the right to dequeue and push output, which the dequeue loop and
+ * the streaming thread share so that the frames go out in order. Unlike
+ * the srcpad stream lock, the dequeue loop does not keep it while it
+ * sleeps. Without wait, returns FALSE if another thread has it. Called
+ * with the state lock.
+ */
+static gboolean
+gst_vpe_push_acquire (GstVpe * self, gboolean wait)
+{
+  while (self->pushing) {
+    if (!wait)
+      return FALSE;
+    g_cond_wait (&self->push_cond, &self->state_lock);
+  }
+  self->pushing = TRUE;
+  return TRUE;
+}
+
+/* Called with the state lock */
+static void
+gst_vpe_push_release (GstVpe * self)
+{
+  self->pushing = FALSE;
+  g_cond_broadcast (&self->push_cond);
+}
+
+/* Push the output buffers handed out ahead, in order. Called with the
+ * push right, without the state lock.
+ */
+static GstFlowReturn
+gst_vpe_push_early (GstVpe * self)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstBuffer *buf;
+
+  while (1) {
+    GST_VPE_STATE_LOCK (self);
+    buf = (GstBuffer *) g_queue_pop_head (&self->early_q);
+    GST_VPE_STATE_UNLOCK (self);
+    if (!buf)
       break;
+    if (ret != GST_FLOW_OK) {
+      gst_buffer_unref (buf);
+      continue;
+    }
+    GST_DEBUG_OBJECT (self, "push ahead: %" GST_TIME_FORMAT " (ptr %p)",
+        GST_TIME_ARGS (GST_BUFFER_PTS (buf)), buf);
+    ret = gst_pad_push (self->srcpad, buf);
+  }
+  return ret;
+}
+
+/* Wait until upstream is done writing buf: on the fence it attached, or
+ * else on the implicit fences of its dmabufs. Called without the state
+ * lock.
+ */
+static void
+gst_vpe_wait_input_fences (GstVpe * self, GstBuffer * buf)
+{
+  GstVpeFenceMeta *meta = gst_buffer_get_vpe_fence_meta (buf);
+  GstMemory *mem;
+  struct pollfd pfd;
+  guint i;
+
+  if (meta) {
+    if (!gst_vpe_fence_wait (meta->fence, FENCE_TIMEOUT))
+      GST_WARNING_OBJECT (self, "Input fence not signalled in time");
+    return;
+  }
+  for (i = 0; i < gst_buffer_n_memory (buf); i++) {
+    mem = gst_buffer_peek_memory (buf, i);
+    if (!gst_is_dmabuf_memory (mem))
+      continue;
+    /* A dmabuf polls readable once its writers are done */
+    pfd.fd = gst_dmabuf_memory_get_fd (mem);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, FENCE_TIMEOUT) == 0)
+      GST_WARNING_OBJECT (self, "Input fd %d not ready in time", pfd.fd);
+  }
+}
+
+/* Copy an output frame into system memory, to be held for reordering */
+static GstBuffer *
+gst_vpe_copy_output (GstBuffer * buf)
+{
+  gsize size = gst_buffer_get_size (buf);
+  GstBuffer *copy = gst_buffer_new_allocate (NULL, size, NULL);
+  GstMapInfo map;
+
+  if (!copy)
+    return NULL;
+  if (!gst_buffer_map (copy, &map, GST_MAP_WRITE)) {
+    gst_buffer_unref (copy);
+    return NULL;
+  }
+  gst_buffer_extract (buf, 0, map.data, size);
+  gst_buffer_unmap (copy, &map);
+  gst_buffer_copy_into (copy, buf, GST_BUFFER_COPY_METADATA, 0, -1);
+  return copy;
+}
+
+/* Push the frames held for the chunk of a reverse playback segment that
+ * has been completely processed. Upstream sends each chunk in forward
+ * order, unless it reordered them already.
+ */
+static GstFlowReturn
+gst_vpe_push_reverse_chunk (GstVpe * self)
+{
+  GQueue chunk;
+  GstBuffer *buf, *first, *last;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gboolean forward;
+
+  GST_VPE_STATE_LOCK (self);
+  chunk = self->reverse_q;
+  g_queue_init (&self->reverse_q);
+  GST_VPE_STATE_UNLOCK (self);
+
+  first = (GstBuffer *) g_queue_peek_head (&chunk);
+  last = (GstBuffer *) g_queue_peek_tail (&chunk);
+  forward = first && GST_BUFFER_PTS_IS_VALID (first) &&
+      GST_BUFFER_PTS_IS_VALID (last) &&
+      GST_BUFFER_PTS (first) < GST_BUFFER_PTS (last);
+  GST_DEBUG_OBJECT (self, "Pushing %d held frames%s", chunk.length,
+      forward ? " in reverse" : "");
+
+  GST_VPE_STATE_LOCK (self);
+  gst_vpe_push_acquire (self, TRUE);
+  GST_VPE_STATE_UNLOCK (self);
+  while (NULL != (buf = (GstBuffer *) (forward ? g_queue_pop_tail (&chunk) :
+              g_queue_pop_head (&chunk)))) {
+    if (ret == GST_FLOW_OK)
+      ret = gst_pad_push (self->srcpad, buf);
+    else
+      gst_buffer_unref (buf);
   }
+  GST_VPE_STATE_LOCK (self);
+  gst_vpe_push_release (self);
+  GST_VPE_STATE_UNLOCK (self);
+  return ret;
+}
+
+/* Account an output frame leaving the driver. Returns when its input was
+ * queued, GST_CLOCK_TIME_NONE if that is not known any more. Called with
+ * the state lock. */
+static GstClockTime
+gst_vpe_output_done (GstVpe * self)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+  guint64 frame;
+
+  self->output_q_processing--;
+  g_assert (self->output_q_processing >= 0);
+  g_cond_broadcast (&self->dequeue_cond);
+  gst_vpe_node_report (self,
+      GST_CLOCK_TIME_IS_VALID (self->last_output_time) ?
+      now - self->last_output_time : GST_CLOCK_TIME_NONE);
+  self->last_output_time =
+      self->output_q_processing ? now : GST_CLOCK_TIME_NONE;
+
+  frame = self->frames_output++ / (self->deinterlace ? 2 : 1);
+  if (frame >= self->frames_queued || self->frames_queued - frame >
+      LATENCY_RING)
+    return GST_CLOCK_TIME_NONE;
+  return self->qbuf_time[frame % LATENCY_RING];
+}
+
+/* Account the latency of an output frame, from the QBUF of its input to
+ * done, the time its push returned. Called with the state lock. */
+static void
+gst_vpe_output_latency (GstVpe * self, GstClockTime qbuf_time,
+    GstClockTime done)
+{
+  if (!GST_CLOCK_TIME_IS_VALID (qbuf_time) || done < qbuf_time)
+    return;
+  GST_OBJECT_LOCK (self);
+  self->latency = done - qbuf_time;
+  self->latency_total += self->latency;
+  self->latency_max = MAX (self->latency_max, self->latency);
+  self->latency_frames++;
+  GST_OBJECT_UNLOCK (self);
+}
+
+/* Refresh what the stats tell of the output pool, which they cannot read
+ * without the state lock. Called with the state lock.
+ */
+static void
+gst_vpe_output_snapshot (GstVpe * self)
+{
   GST_OBJECT_LOCK (self);
-  if (self->video_fd >= 0 && self->input_pool) {
-    while (NULL != (buf = gst_vpe_buffer_pool_dequeue (self->input_pool))) {
-      self->input_q_depth--;
-      g_assert (self->input_q_depth >= 0);
+  if (self->output_pool) {
+    self->output_buffers = self->output_pool->buffer_count;
+    self->output_hold_time = self->output_pool->hold_time;
+  } else {
+    self->output_buffers = 0;
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
+/* Take the processed frames from the driver, all the ready ones with a
+ * single pass over the locks, and push them (or hold them in reverse
+ * playback) once the locks are released. The latency of a pushed frame
+ * counts until its push returns. Returns the number of frames dequeued,
+ * and the flow return of the pushes in flow. Called with the push right,
+ * without the state lock.
+ */
+static guint
+gst_vpe_dequeue_output (GstVpe * self, GstFlowReturn * flow)
+{
+  GQueue out = G_QUEUE_INIT, early = G_QUEUE_INIT;
+  GstClockTime qbuf[MAX_REQBUF_CNT], done[MAX_REQBUF_CNT], now;
+  GstVpeFenceMeta *meta;
+  GstBuffer *buf = NULL, *b;
+  GList *l, *next;
+  gboolean reverse;
+  guint n, ready, i, j;
+  gint q_cnt;
+
+  *flow = GST_FLOW_OK;
+  GST_VPE_STATE_LOCK (self);
+  if (self->video_fd >= 0 && self->output_pool) {
+    ready = gst_vpe_buffer_pool_dequeue_all (self->output_pool, NULL);
+    while (out.length < MIN (ready, MAX_REQBUF_CNT) && GST_FLOW_OK ==
+        gst_buffer_pool_acquire_buffer (GST_BUFFER_POOL (self->output_pool),
+            &buf, NULL))
+      g_queue_push_tail (&out, buf);
+  }
+  n = out.length;
+  /* Frames pushed ahead only have their fence to signal, they are done
+   * with it */
+  now = gst_util_get_timestamp ();
+  for (l = out.head; l; l = next) {
+    next = l->next;
+    meta = gst_buffer_get_vpe_fence_meta ((GstBuffer *) l->data);
+    if (!meta || gst_vpe_fence_is_signalled (meta->fence))
+      continue;
+    gst_vpe_fence_signal (meta->fence);
+    self->early_in_flight--;
+    gst_vpe_output_latency (self, gst_vpe_output_done (self), now);
+    g_queue_push_tail (&early, l->data);
+    g_queue_delete_link (&out, l);
+  }
+  reverse = self->reverse;
+  if (!reverse)
+    for (i = 0; i < out.length; i++)
+      qbuf[i] = gst_vpe_output_done (self);
+  gst_vpe_output_snapshot (self);
+  GST_VPE_STATE_UNLOCK (self);
+
+  while (NULL != (buf = (GstBuffer *) g_queue_pop_head (&early)))
+    gst_buffer_unref (buf);
+
+  if (reverse) {
+    /* Hold copies for reordering and give the driver buffers back at
+     * once. The frames only count as processed once they are held, so
+     * that gst_vpe_drain() sees them. */
+    for (l = out.head; l; l = l->next) {
+      b = gst_vpe_copy_output ((GstBuffer *) l->data);
+      gst_buffer_unref ((GstBuffer *) l->data);
+      l->data = b;
+    }
+    now = gst_util_get_timestamp ();
+    GST_VPE_STATE_LOCK (self);
+    while (!g_queue_is_empty (&out)) {
+      b = (GstBuffer *) g_queue_pop_head (&out);
+      if (b)
+        g_queue_push_tail (&self->reverse_q, b);
+      gst_vpe_output_latency (self, gst_vpe_output_done (self), now);
+    }
+    GST_VPE_STATE_UNLOCK (self);
+    return n;
+  }
+
+  for (i = 0; NULL != (buf = (GstBuffer *) g_queue_pop_head (&out)); i++) {
+    done[i] = GST_CLOCK_TIME_NONE;
+    if (*flow != GST_FLOW_OK) {
       gst_buffer_unref (buf);
+      continue;
     }
-    while (((MAX_INPUT_Q_DEPTH - self->input_q_depth) >= 1)
-        && (NULL != (buf = (GstBuffer *) g_queue_pop_head (&self->input_q)))
-        && (TRUE == gst_vpe_buffer_pool_queue (self->input_pool, buf, &q_cnt))) {
-      self->input_q_depth += q_cnt;
-      if (self->interlaced) {
-        self->output_q_processing += q_cnt * 2;
-      } else {
-        self->output_q_processing += q_cnt;
-      }
+    for (q_cnt = 1; q_cnt < self->output_repeat_rate; q_cnt++) {
+      b = gst_vpe_buffer_ref (self->output_pool, buf);
+      if (b && *flow == GST_FLOW_OK)
+        *flow = gst_pad_push (self->srcpad, GST_BUFFER (b));
+      else if (b)
+        gst_buffer_unref (b);
+    }
+    GST_DEBUG_OBJECT (self, "push: %" GST_TIME_FORMAT " (ptr %p)",
+        GST_TIME_ARGS (GST_BUFFER_PTS (buf)), buf);
+    if (*flow == GST_FLOW_OK) {
+      *flow = gst_pad_push (self->srcpad, GST_BUFFER (buf));
+      done[i] = gst_util_get_timestamp ();
+    } else {
+      gst_buffer_unref (buf);
+    }
+  }
+  if (*flow != GST_FLOW_OK)
+    GST_DEBUG_OBJECT (self, "push returned %s", gst_flow_get_name (*flow));
+
+  GST_VPE_STATE_LOCK (self);
+  for (j = 0; j < i; j++)
+    if (GST_CLOCK_TIME_IS_VALID (done[j]))
+      gst_vpe_output_latency (self, qbuf[j], done[j]);
+  GST_VPE_STATE_UNLOCK (self);
+  return n;
+}
+
+/* Recycle the input buffers the driver is done with, and queue the ones
+ * held back that fit now, each in one batch. Called with the state lock.
+ */
+static void
+gst_vpe_dequeue_input (GstVpe * self)
+{
+  GQueue batch = G_QUEUE_INIT;
+  GArray *times = NULL;
+  GstBuffer *buf;
+  GList *l;
+  guint n, i;
+
+  if (self->video_fd < 0 || !self->input_pool)
+    return;
+  self->input_q_depth -=
+      gst_vpe_buffer_pool_dequeue_all (self->input_pool, &batch);
+  g_assert (self->input_q_depth >= 0);
+  while (NULL != (buf = (GstBuffer *) g_queue_pop_head (&batch)))
+    gst_buffer_unref (buf);
+
+  /* Each frame taken counts against the depth the next one is checked
+   * with */
+  while (!self->reconfiguring
+      && (NULL != (buf = (GstBuffer *) g_queue_peek_head (&self->input_q)))
+      && gst_vpe_can_queue_input (self, buf)) {
+    g_queue_push_tail (&batch, g_queue_pop_head (&self->input_q));
+    self->input_q_depth++;
+  }
+  if (g_queue_is_empty (&batch))
+    return;
+  self->input_q_depth -= batch.length;
+  if (self->fence_mode == GST_VPE_FENCE_EARLY) {
+    /* Read before queueing, the driver owns the buffers afterwards */
+    times = g_array_sized_new (FALSE, FALSE, sizeof (GstClockTime),
+        2 * batch.length);
+    for (l = batch.head; l; l = l->next) {
+      g_array_append_val (times, GST_BUFFER_PTS ((GstBuffer *) l->data));
+      g_array_append_val (times, GST_BUFFER_DURATION ((GstBuffer *) l->data));
+    }
+  }
+  n = gst_vpe_buffer_pool_queue_all (self->input_pool, &batch);
+  for (i = 0; i < n; i++) {
+    if (times)
+      gst_vpe_queue_early (self, g_array_index (times, GstClockTime, 2 * i),
+          g_array_index (times, GstClockTime, 2 * i + 1));
+    gst_vpe_input_queued (self, 1);
+  }
+  if (times)
+    g_array_free (times, TRUE);
+  /* The driver refused one, the others wait */
+  while (NULL != (buf = (GstBuffer *) g_queue_pop_tail (&batch)))
+    g_queue_push_head (&self->input_q, buf);
+}
+
+/* In low latency mode, wait for the frames of the buffer just received
+ * and push them from the streaming thread. Called with the push right,
+ * without the state lock.
+ */
+static GstFlowReturn
+gst_vpe_push_output_sync (GstVpe * self)
+{
+  gint64 deadline = g_get_monotonic_time () +
+      LOW_LATENCY_TIMEOUT * G_TIME_SPAN_MILLISECOND;
+  GstFlowReturn ret = GST_FLOW_OK;
+  struct pollfd pfd;
+  gint timeout;
+  guint pushed = 0, n;
+  gboolean done;
+
+  while (ret == GST_FLOW_OK) {
+    GST_VPE_STATE_LOCK (self);
+    gst_vpe_dequeue_input (self);
+    pfd.fd = self->video_fd;
+    done = g_queue_is_empty (&self->input_q) &&
+        (self->output_q_processing == 0 ||
+        pushed >= (self->deinterlace ? 2u : 1u));
+    GST_VPE_STATE_UNLOCK (self);
+    if (done || pfd.fd < 0)
+      break;
+    if ((n = gst_vpe_dequeue_output (self, &ret))) {
+      pushed += n;
+      continue;
+    }
+    timeout = (deadline - g_get_monotonic_time ()) / G_TIME_SPAN_MILLISECOND;
+    if (timeout <= 0) {
+      GST_DEBUG_OBJECT (self, "Frame not back in time, the task pushes it");
+      break;
     }
+    pfd.events = POLLIN | POLLOUT;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, timeout) < 0 && errno != EINTR)
+      break;
+  }
+  return ret;
+}
+
+/* Apply task-priority and cpu-affinity to the srcpad task. Runs from the
+ * task itself, as the pad gives no hook before its thread runs, whenever
+ * it finds itself in a new thread or the options changed.
+ */
+static void
+gst_vpe_task_sched (GstVpe * self)
+{
+  struct sched_param param;
+  cpu_set_t cpus;
+  gint priority, policy, r, i;
+  guint mask;
+
+  GST_OBJECT_LOCK (self);
+  if (self->task_thread == g_thread_self () &&
+      !g_atomic_int_compare_and_exchange (&self->task_sched_changed, TRUE,
+          FALSE)) {
+    GST_OBJECT_UNLOCK (self);
+    return;
+  }
+  g_atomic_int_set (&self->task_sched_changed, FALSE);
+  if (self->task_thread != g_thread_self ()) {
+    self->task_thread = g_thread_self ();
+    self->task_saved = FALSE;
+    self->task_clock_valid =
+        pthread_getcpuclockid (pthread_self (), &self->task_clock) == 0;
+  }
+  priority = self->task_priority;
+  policy = self->task_policy == GST_VPE_TASK_POLICY_RR ? SCHED_RR : SCHED_FIFO;
+  mask = self->cpu_affinity;
+  /* Unless asked to, keep what the application set on STREAM_STATUS
+   * ENTER, and what to give back once we changed it */
+  if (!self->task_saved) {
+    if (!priority && !mask) {
+      GST_OBJECT_UNLOCK (self);
+      return;
+    }
+    if (pthread_getschedparam (pthread_self (), &self->task_saved_policy,
+            &self->task_saved_param)
+        || pthread_getaffinity_np (pthread_self (),
+            sizeof (self->task_saved_cpus), &self->task_saved_cpus)) {
+      GST_OBJECT_UNLOCK (self);
+      GST_WARNING_OBJECT (self, "Cannot read the task thread settings, "
+          "leaving them");
+      return;
+    }
+    self->task_saved = TRUE;
+  }
+  if (priority) {
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = priority;
+  } else {
+    policy = self->task_saved_policy;
+    param = self->task_saved_param;
+  }
+  if (mask) {
+    CPU_ZERO (&cpus);
+    for (i = 0; i < 32; i++)
+      if (mask & (1u << i))
+        CPU_SET (i, &cpus);
+  } else {
+    cpus = self->task_saved_cpus;
   }
   GST_OBJECT_UNLOCK (self);
+
+  r = pthread_setschedparam (pthread_self (), policy, &param);
+  if (r)
+    GST_WARNING_OBJECT (self, "Cannot set task priority %d: %s", priority,
+        g_strerror (r));
+  r = pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+  if (r)
+    GST_WARNING_OBJECT (self, "Cannot set CPU affinity 0x%x: %s", mask,
+        g_strerror (r));
+  GST_DEBUG_OBJECT (self, "Task priority %d, CPU affinity 0x%x", priority,
+      mask);
+}
+
+/* Read the CPU time of a thread, or the last value once it is gone */
+static GstClockTime
+gst_vpe_thread_cpu_time (clockid_t clock, gboolean valid, GstClockTime * last)
+{
+  struct timespec ts;
+
+  if (valid && clock_gettime (clock, &ts) == 0)
+    *last = GST_TIMESPEC_TO_TIME (ts);
+  return *last;
+}
+
+/* The task threads are pooled: give the thread back as it was found, then
+ * post what the pad would have posted. */
+static void
+gst_vpe_task_leave (GstTask * task, GThread * thread, gpointer user_data)
+{
+  GstVpe *self = GST_VPE (user_data);
+  struct sched_param param;
+  cpu_set_t cpus;
+  GstMessage *message;
+  GValue value = { 0 };
+  gint policy = SCHED_OTHER;
+  gboolean restore = FALSE;
+
+  GST_OBJECT_LOCK (self);
+  if (self->task_thread == g_thread_self ()) {
+    restore = self->task_saved;
+    policy = self->task_saved_policy;
+    param = self->task_saved_param;
+    cpus = self->task_saved_cpus;
+    self->task_thread = NULL;
+    self->task_saved = FALSE;
+  }
+  /* The pool may give the thread to someone else */
+  gst_vpe_thread_cpu_time (self->task_clock, self->task_clock_valid,
+      &self->task_cpu_time);
+  self->task_clock_valid = FALSE;
+  GST_OBJECT_UNLOCK (self);
+
+  if (restore) {
+    pthread_setschedparam (pthread_self (), policy, &param);
+    pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+  }
+
+  message = gst_message_new_stream_status (GST_OBJECT_CAST (self->srcpad),
+      GST_STREAM_STATUS_TYPE_LEAVE, GST_ELEMENT_CAST (self));
+  g_value_init (&value, GST_TYPE_TASK);
+  g_value_set_object (&value, task);
+  gst_message_set_stream_status_object (message, &value);
+  g_value_unset (&value);
+  gst_element_post_message (GST_ELEMENT_CAST (self), message);
+}
+
+static void
+gst_vpe_dequeue_loop (gpointer data)
+{
+  GstVpe *self = (GstVpe *) data;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  gst_vpe_task_sched (self);
+
+  GST_VPE_STATE_LOCK (self);
+  if (g_atomic_int_get (&self->schedule_changed))
+    gst_vpe_schedule (self);
+  if (self->prewarm_pending) {
+    self->prewarm_pending = FALSE;
+    GST_VPE_STATE_UNLOCK (self);
+    gst_vpe_decide_allocation (self);
+    GST_VPE_STATE_LOCK (self);
+    gst_vpe_prewarm (self);
+  }
+  GST_VPE_STATE_UNLOCK (self);
+
+  /* The streaming thread may be pushing in low latency mode, it takes
+   * the frames then */
+  GST_VPE_STATE_LOCK (self);
+  if (gst_vpe_push_acquire (self, FALSE)) {
+    GST_VPE_STATE_UNLOCK (self);
+    while (ret == GST_FLOW_OK && gst_vpe_dequeue_output (self, &ret));
+    if (ret == GST_FLOW_OK)
+      ret = gst_vpe_push_early (self);
+    GST_VPE_STATE_LOCK (self);
+    gst_vpe_push_release (self);
+    /* The streaming thread returns it from chain */
+    if (ret != GST_FLOW_OK && self->output_flow == GST_FLOW_OK)
+      self->output_flow = ret;
+  }
+  gst_vpe_dequeue_input (self);
+  GST_VPE_STATE_UNLOCK (self);
   usleep (10000);
 }
 
@@ -548,20 +1913,149 @@ gst_vpe_print_driver_capabilities (GstVpe * self)
   }
 }
 
+static void
+gst_vpe_close_fd (gpointer fd)
+{
+  close (GPOINTER_TO_INT (fd));
+}
+
+/* Let func release data, from the reaper unless async-teardown is off.
+ * The job counts against the device we last opened. Called with the
+ * state lock.
+ */
+static void
+gst_vpe_teardown (GstVpe * self, GDestroyNotify func, gpointer data)
+{
+  if (self->async_teardown)
+    gst_vpe_reap (self->reap_node, func, data);
+  else
+    func (data);
+}
+
+static void
+gst_vpe_close_node (GstVpe * self)
+{
+  gchar *node;
+
+  GST_OBJECT_LOCK (self);
+  node = self->node;
+  self->node = NULL;
+  GST_OBJECT_UNLOCK (self);
+  if (node) {
+    gst_vpe_node_release (node, self);
+    g_free (node);
+  }
+}
+
+/* Pass our priority and frame rate on to the scheduler. Called with the
+ * state lock.
+ */
+static void
+gst_vpe_schedule (GstVpe * self)
+{
+  GstClockTime interval = 0;
+  gint fps_n, fps_d;
+  guint priority;
+
+  g_atomic_int_set (&self->schedule_changed, FALSE);
+  if (!self->node)
+    return;
+  GST_OBJECT_LOCK (self);
+  fps_n = self->target_framerate_n;
+  fps_d = self->target_framerate_d;
+  priority = self->priority;
+  GST_OBJECT_UNLOCK (self);
+  if (fps_n <= 0) {
+    fps_n = self->input_framerate_n;
+    fps_d = self->input_framerate_d;
+  }
+  if (fps_n > 0 && fps_d > 0)
+    interval = gst_util_uint64_scale_int (GST_SECOND, fps_d, fps_n);
+  gst_vpe_node_set_schedule (self->node, self, priority, interval);
+}
+
+/* Called with the state lock, which is released while the reaper
+ * finishes with the device. Returns FALSE if the device was closed
+ * meanwhile.
+ */
+static gboolean
+gst_vpe_open_device (GstVpe * self)
+{
+  const gchar *device;
+  gchar *pool, *node;
+
+  if (self->video_fd >= 0)
+    return TRUE;
+  /* Every stream gets its own context, on the least loaded node of the
+   * pool if there is one. A node kept from an attempt that had to wait
+   * is used again. */
+  if (!self->node) {
+    GST_OBJECT_LOCK (self);
+    pool = g_strdup (self->device_pool && self->device_pool[0] ?
+        self->device_pool : self->device);
+    GST_OBJECT_UNLOCK (self);
+    node = pool ? gst_vpe_node_acquire (pool, self) : NULL;
+    g_free (pool);
+    GST_OBJECT_LOCK (self);
+    self->node = node;
+    GST_OBJECT_UNLOCK (self);
+    if (!self->node) {
+      GST_ERROR_OBJECT (self, "No device set");
+      return FALSE;
+    }
+    gst_vpe_schedule (self);
+  }
+  node = self->node;
+  g_free (self->reap_node);
+  self->reap_node = g_strdup (node);
+  /* The driver and memory the previous streams left on this device are
+   * released first. Only the state accessors would wait meanwhile. */
+  node = g_strdup (node);
+  GST_VPE_STATE_UNLOCK (self);
+  gst_vpe_reaper_join (node);
+  GST_VPE_STATE_LOCK (self);
+  g_free (node);
+  if (self->video_fd >= 0)
+    return TRUE;
+  if (!self->node) {
+    GST_DEBUG_OBJECT (self, "Device closed while waiting for the reaper");
+    return FALSE;
+  }
+  device = self->node;
+  GST_DEBUG_OBJECT (self, "Calling open(%s)", device);
+  self->video_fd = open (device, O_RDWR | O_NONBLOCK);  //open vpe device
+  if (self->video_fd < 0) {
+    GST_ERROR_OBJECT (self, "Cant open %s", device);
+    gst_vpe_close_node (self);
+    return FALSE;
+  }
+  self->last_output_time = GST_CLOCK_TIME_NONE;
+  GST_DEBUG_OBJECT (self, "Opened %s", device);
+  gst_vpe_print_driver_capabilities (self);
+  return TRUE;
+}
+
 static gboolean
 gst_vpe_create (GstVpe * self)
 {
-  if (self->dev == NULL) {
-    printf
-        ("gstvpe.c: gst_vpe_create(), self->dev == NULL, calling dce_init()...");
-    self->dev = dce_init ();
+  if (self->allocator == NULL &&
+      self->allocator_type != GST_VPE_ALLOCATOR_OMAP_DRM) {
+    self->allocator = gst_vpe_heap_allocator_new (self->allocator_type);
+    if (self->allocator == NULL) {
+      GST_ERROR_OBJECT (self, "Cannot create the %s allocator",
+          self->allocator_type == GST_VPE_ALLOCATOR_DMA_HEAP ?
+          "dma-heap" : "udmabuf");
+      return FALSE;
+    }
+  }
+  /* omap_drm is only needed to allocate and import omap dmabufs */
+  if (self->dev == NULL && self->memory_mode == GST_VPE_MEMORY_MODE_DMABUF
+      && self->allocator_type == GST_VPE_ALLOCATOR_OMAP_DRM) {
+    self->dev = gst_vpe_device_get ();
     if (self->dev == NULL) {
-      printf ("dce_init() failed, returning FALSE\n");
-      GST_ERROR_OBJECT (self, "dce_init() failed");
+      GST_ERROR_OBJECT (self, "Cannot get the omap device");
       return FALSE;
     }
-    printf ("dce_init() succeeded, returning TRUE\n");
-    GST_DEBUG_OBJECT (self, "dce_init() done"); //succeeds
   }
   return TRUE;
 }
@@ -619,63 +2113,153 @@ gst_vpe_init_input_bufs (GstVpe * self, GstCaps * input_caps)
   return TRUE;
 }
 
+/* Whether the driver is still set up for the current caps and input
+ * layout, from before the last stream off. Called with the state lock.
+ */
+static gboolean
+gst_vpe_config_matches (GstVpe * self)
+{
+  return self->config.valid && self->video_fd >= 0 &&
+      self->input_pool && self->input_pool->reqbuf_count &&
+      self->output_pool && self->output_pool->reqbuf_count &&
+      self->input_caps && self->output_caps &&
+      gst_caps_is_equal (self->config.input_caps, self->input_caps) &&
+      gst_caps_is_equal (self->config.output_caps, self->output_caps) &&
+      self->config.trickmode == self->trickmode &&
+      self->config.input_num_planes == self->input_num_planes &&
+      self->config.input_stride[0] == self->input_stride[0] &&
+      self->config.input_stride[1] == self->input_stride[1] &&
+      !memcmp (&self->config.input_crop, &self->input_crop,
+      sizeof (self->input_crop));
+}
+
+/* Called with the state lock */
+static void
+gst_vpe_save_config (GstVpe * self)
+{
+  gst_caps_replace (&self->config.input_caps, self->input_caps);
+  gst_caps_replace (&self->config.output_caps, self->output_caps);
+  self->config.trickmode = self->trickmode;
+  self->config.input_num_planes = self->input_num_planes;
+  self->config.input_stride[0] = self->input_stride[0];
+  self->config.input_stride[1] = self->input_stride[1];
+  self->config.input_crop = self->input_crop;
+  self->config.valid = self->input_caps && self->output_caps;
+}
+
+/* Let the driver drop what it kept over a stream off: its buffers and the
+ * context they live in. Called with the state lock.
+ */
 static void
+gst_vpe_forget_config (GstVpe * self)
+{
+  if (self->input_pool)
+    gst_vpe_buffer_pool_release_driver (self->input_pool);
+  if (self->output_pool)
+    gst_vpe_buffer_pool_release_driver (self->output_pool);
+  /* The last close releases the driver queues */
+  if (self->video_fd >= 0)
+    gst_vpe_teardown (self, gst_vpe_close_fd,
+        GINT_TO_POINTER (self->video_fd));
+  self->video_fd = -1;
+  gst_vpe_close_node (self);
+  gst_caps_replace (&self->config.input_caps, NULL);
+  gst_caps_replace (&self->config.output_caps, NULL);
+  self->config.valid = FALSE;
+}
+
+/* Turn streaming on or off. If it cannot be turned on, whatever the
+ * driver was set up with is dropped, so that it does not outlive the
+ * failure. Returns FALSE then. Called with the state lock.
+ */
+static gboolean
 gst_vpe_set_streaming (GstVpe * self, gboolean streaming)
 {
   printf ("gstvpe.c:gst_vpe_set_streaming: entered gst_vpe_set_streaming\n");
-  gboolean ret;
+  gboolean ret, cached;
   GstBuffer *buf;
   if (streaming) {
-    if (self->video_fd < 0) {
-      GST_DEBUG_OBJECT (self, "Calling open(%s)", self->device);
-      self->video_fd = open (self->device, O_RDWR | O_NONBLOCK);        //open vpe device
-      if (self->video_fd < 0) {
-        GST_ERROR_OBJECT (self, "Cant open %s", self->device);
-        return;
-      }
-      GST_DEBUG_OBJECT (self, "Opened %s", self->device);
-      gst_vpe_print_driver_capabilities (self);
+    if (self->video_fd < 0 || !self->output_pool
+        || !self->output_pool->streaming) {
+      cached = gst_vpe_config_matches (self);
+      GST_OBJECT_LOCK (self);
+      if (self->config.valid)
+        self->restarts++;
+      if (cached)
+        self->cached_restarts++;
+      GST_OBJECT_UNLOCK (self);
+      if (!cached && self->config.valid)
+        gst_vpe_forget_config (self);
+      if (!gst_vpe_open_device (self))
+        return FALSE;
+      /* Stopped while the state lock was released */
+      if (self->state == GST_VPE_ST_DEINIT || !self->input_pool)
+        return FALSE;
 
-      /* Call V4L2 S_FMT for input and output */
-      gst_vpe_input_set_fmt (self);
-      gst_vpe_output_set_fmt (self);
+      if (cached) {
+        GST_DEBUG_OBJECT (self, "Restarting with the formats and buffers "
+            "the driver kept");
+      } else {
+        /* Call V4L2 S_FMT for input and output. The format cannot change
+         * once a prewarmed output pool requested driver buffers */
+        if (!gst_vpe_input_set_fmt (self) || ((!self->output_pool ||
+                    !self->output_pool->reqbuf_count) &&
+                !gst_vpe_output_set_fmt (self))) {
+          GST_ERROR_OBJECT (self, "Cannot set the driver formats");
+          goto fail;
+        }
+      }
 
       if (!gst_vpe_init_input_bufs (self, NULL)) {      //this likely fails pretty hard.
         printf
             ("gstvpe.c:gst_vpe_set_streaming, gst_vpe_init_input_bufs failed.\n");
         GST_ERROR_OBJECT (self, "gst_vpe_init_input_bufs failed");
+        goto fail;
       }
       if (self->input_pool) {
         printf ("gstvpe.c:gst_vpe_set_streaming: if(self->input_pool)\n");
-        gst_vpe_buffer_pool_set_streaming (self->input_pool, self->video_fd, streaming, self->interlaced);      //because this doesn't receive the FALSE gboolean return value, it continues with nothing?
+        if (!gst_vpe_buffer_pool_set_streaming (self->input_pool,
+                self->video_fd, streaming, self->deinterlace)) {
+          GST_ERROR_OBJECT (self, "Cannot start the input queue");
+          goto fail;
+        }
       }
       self->output_q_processing = 0;
+      self->early_in_flight = 0;
+      self->frames_queued = self->frames_output = 0;
 
       if (!self->output_pool) {
         if (!gst_vpe_init_output_buffers (self)) {
           GST_ERROR_OBJECT (self, "gst_vpe_init_output_buffers failed");
+          goto fail;
         }
         GST_DEBUG_OBJECT (self, "gst_vpe_init_output_buffers done");
       }
       if (self->output_pool) {
         printf ("gstvpe.c:gst_vpe_set_streaming: if(self->output_pool\n");
-        gst_vpe_buffer_pool_set_streaming (self->output_pool,
-            self->video_fd, streaming, FALSE);
+        if (!gst_vpe_buffer_pool_set_streaming (self->output_pool,
+                self->video_fd, streaming, FALSE)) {
+          GST_ERROR_OBJECT (self, "Cannot start the output queue");
+          goto fail;
+        }
       }
       self->input_q_depth = 0;
+      gst_vpe_save_config (self);
     } else {
       GST_DEBUG_OBJECT (self, "streaming already on");
     }
   } else {
     if (self->video_fd >= 0) {  //video_fd has been initialized
       while (NULL != (buf = (GstBuffer *) g_queue_pop_head (&self->input_q))) {
+        if (self->input_pool)
+          gst_vpe_buffer_pool_unreserve (self->input_pool, buf);
         gst_buffer_unref (buf);
       }
       if (self->input_pool) {
         printf
             ("gstvpe.c:gst_vpe_set_streaming: if(self->video_fd >= 0) && if(self->input_pool)\n");
         gst_vpe_buffer_pool_set_streaming (self->input_pool, self->video_fd,
-            streaming, self->interlaced);
+            streaming, self->deinterlace);
       }
       if (self->output_pool) {
         printf
@@ -683,12 +2267,168 @@ gst_vpe_set_streaming (GstVpe * self, gboolean streaming)
         gst_vpe_buffer_pool_set_streaming (self->output_pool, self->video_fd,
             streaming, FALSE);
       }
-      close (self->video_fd);
-      self->video_fd = -1;
+      g_queue_foreach (&self->early_q, (GFunc) gst_buffer_unref, NULL);
+      g_queue_clear (&self->early_q);
+      self->early_in_flight = 0;
+      /* The device stays open with its formats and buffers until
+       * gst_vpe_forget_config(), nothing is in flight any more */
+      self->output_q_processing = 0;
+      gst_vpe_node_report (self, GST_CLOCK_TIME_NONE);
+      if (self->node)
+        gst_vpe_node_idle (self->node, self);
+      g_cond_broadcast (&self->dequeue_cond);
     } else {
       GST_DEBUG_OBJECT (self, "streaming already off");
     }
   }
+  return TRUE;
+
+fail:
+  /* The kept formats and buffers, or the fd of a fresh start, are of no
+   * use for a retry */
+  if (self->input_pool)
+    gst_vpe_buffer_pool_set_streaming (self->input_pool, self->video_fd,
+        FALSE, self->deinterlace);
+  if (self->output_pool)
+    gst_vpe_buffer_pool_set_streaming (self->output_pool, self->video_fd,
+        FALSE, FALSE);
+  gst_vpe_forget_config (self);
+  return FALSE;
+}
+
+/* Set up everything that does not depend on the first buffer: formats,
+ * input pool and output buffers. Runs from the dequeue loop once the caps
+ * are known, while upstream is still producing its first frame. Called
+ * with the state lock.
+ */
+static void
+gst_vpe_prewarm (GstVpe * self)
+{
+  if (self->state != GST_VPE_ST_INIT || self->output_pool)
+    return;
+  GST_DEBUG_OBJECT (self, "Prewarming");
+  /* New caps, whatever the driver kept is of no use */
+  if (self->config.valid)
+    gst_vpe_forget_config (self);
+  if (!gst_vpe_init_input_bufs (self, NULL) || !gst_vpe_open_device (self))
+    return;
+  /* The state lock was released while opening */
+  if (self->state != GST_VPE_ST_INIT || self->output_pool)
+    return;
+  if (!gst_vpe_input_set_fmt (self) || !gst_vpe_output_set_fmt (self)
+      || !gst_vpe_init_output_buffers (self)) {
+    GST_WARNING_OBJECT (self, "Prewarm failed, setting up on first buffer");
+    if (self->output_pool)
+      gst_vpe_buffer_pool_destroy (self->output_pool);
+    self->output_pool = NULL;
+    return;
+  }
+  GST_DEBUG_OBJECT (self, "Prewarm done");
+}
+
+/* Copy a system memory buffer into a buffer of the input pool. Called with
+ * the state lock, which is released while waiting for a free buffer so
+ * that the dequeue loop can give back the ones the driver is done with.
+ */
+static GstBuffer *
+gst_vpe_upload_input (GstVpe * self, GstBuffer * buf)
+{
+  GstBufferPool *pool = gst_object_ref (self->input_pool);
+  GstBuffer *out = NULL;
+  GstClockTime start, elapsed = 0;
+
+  if (!self->upload)
+    self->upload = gst_vpe_upload_new ();
+  GST_VPE_STATE_UNLOCK (self);
+
+  if (gst_buffer_pool_acquire_buffer (pool, &out, NULL) != GST_FLOW_OK)
+    out = NULL;
+  gst_object_unref (pool);
+  if (out) {
+    start = gst_util_get_timestamp ();
+    if (!gst_vpe_upload_frame (self->upload, out, buf, self->input_fourcc,
+            self->input_width, self->input_height)) {
+      gst_buffer_unref (out);
+      out = NULL;
+    }
+    elapsed = gst_util_get_timestamp () - start;
+  }
+  gst_buffer_unref (buf);
+
+  GST_VPE_STATE_LOCK (self);
+  if (out) {
+    GST_OBJECT_LOCK (self);
+    self->upload_frames++;
+    self->upload_time = elapsed;
+    self->upload_time_total += elapsed;
+    GST_OBJECT_UNLOCK (self);
+    GST_DEBUG_OBJECT (self, "Uploaded system memory frame in %"
+        GST_TIME_FORMAT, GST_TIME_ARGS (elapsed));
+  }
+  return out;
+}
+
+/* Whether buf can be queued to the driver without a copy */
+static gboolean
+gst_vpe_input_importable (GstVpe * self, GstBuffer * buf)
+{
+  GstMemory *mem = gst_buffer_peek_memory (buf, 0);
+  GstMapInfo info;
+  gboolean ret;
+
+  switch (self->memory_mode) {
+    case GST_VPE_MEMORY_MODE_MMAP:
+      /* Only the driver's own buffers */
+      return gst_buffer_get_vpe_buffer_priv (self->input_pool, buf) != NULL;
+    case GST_VPE_MEMORY_MODE_USERPTR:
+      if (gst_is_fd_memory (mem) || gst_buffer_n_memory (buf) > 1 ||
+          !gst_memory_map (mem, &info, GST_MAP_READ))
+        return FALSE;
+      ret = ((guintptr) info.data & (sysconf (_SC_PAGESIZE) - 1)) == 0;
+      gst_memory_unmap (mem, &info);
+      return ret;
+    default:
+      return gst_is_fd_memory (mem);
+  }
+}
+
+/* Called with the object lock */
+static GstStructure *
+gst_vpe_get_stats (GstVpe * self)
+{
+  guint pinned_buffers;
+  guint64 usage = gst_vpe_memory_get_usage (&pinned_buffers);
+
+  return gst_structure_new ("GstVpeStats",
+      "upload-frames", G_TYPE_UINT64, self->upload_frames,
+      "upload-time", G_TYPE_UINT64, self->upload_time,
+      "upload-time-average", G_TYPE_UINT64, self->upload_frames ?
+      self->upload_time_total / self->upload_frames : (guint64) 0,
+      "memory-usage", G_TYPE_UINT64, usage,
+      "pinned-buffers", G_TYPE_UINT, pinned_buffers,
+      "over-budget", G_TYPE_BOOLEAN, self->over_budget,
+      "device", G_TYPE_STRING, self->node ? self->node : self->device,
+      "dropped-oldest", G_TYPE_UINT64, self->dropped[GST_VPE_DROP_OLDEST],
+      "dropped-newest", G_TYPE_UINT64, self->dropped[GST_VPE_DROP_NEWEST],
+      "dropped-keep-every-nth", G_TYPE_UINT64,
+      self->dropped[GST_VPE_DROP_KEEP_NTH],
+      "latency", G_TYPE_UINT64, self->latency,
+      "latency-average", G_TYPE_UINT64, self->latency_frames ?
+      self->latency_total / self->latency_frames : (guint64) 0,
+      "latency-max", G_TYPE_UINT64, self->latency_max,
+      "input-queue-depth", G_TYPE_INT, self->input_queue_depth ?
+      self->input_queue_depth : self->input_q_max,
+      "output-buffers", G_TYPE_INT, self->output_buffers,
+      "downstream-hold-time", G_TYPE_UINT64, self->output_hold_time,
+      "task-cpu-time", G_TYPE_UINT64,
+      gst_vpe_thread_cpu_time (self->task_clock, self->task_clock_valid,
+          &self->task_cpu_time),
+      "chain-cpu-time", G_TYPE_UINT64,
+      gst_vpe_thread_cpu_time (self->chain_clock, self->chain_clock_valid,
+          &self->chain_cpu_time),
+      "early-frames", G_TYPE_UINT64, self->early_frames,
+      "restarts", G_TYPE_UINT64, self->restarts,
+      "cached-restarts", G_TYPE_UINT64, self->cached_restarts, NULL);
 }
 
 static gboolean
@@ -705,6 +2445,19 @@ gst_vpe_start (GstVpe * self, GstCaps * input_caps)
       return FALSE;
     }
   }
+  GST_OBJECT_LOCK (self);
+  self->upload_frames = 0;
+  self->upload_time = 0;
+  self->upload_time_total = 0;
+  memset (self->dropped, 0, sizeof (self->dropped));
+  self->latency = self->latency_total = self->latency_max = 0;
+  self->latency_frames = 0;
+  self->input_q_max = START_INPUT_Q_DEPTH;
+  GST_OBJECT_UNLOCK (self);
+  self->auto_frames = self->auto_waits = self->auto_idle = 0;
+  self->auto_peak = 0;
+  self->overload_frames = 0;
+  self->output_flow = GST_FLOW_OK;
   self->state = GST_VPE_ST_ACTIVE;
   return TRUE;
 }
@@ -713,6 +2466,9 @@ static void
 gst_vpe_destroy (GstVpe * self)
 {
   gst_vpe_set_streaming (self, FALSE);
+  gst_vpe_forget_config (self);
+  g_queue_foreach (&self->reverse_q, (GFunc) gst_buffer_unref, NULL);
+  g_queue_clear (&self->reverse_q);
   if (self->input_caps)
     gst_caps_unref (self->input_caps);
   self->input_caps = NULL;
@@ -721,21 +2477,27 @@ gst_vpe_destroy (GstVpe * self)
   self->output_caps = NULL;
   self->fixed_caps = FALSE;
   if (self->input_pool) {
-    gst_vpe_buffer_pool_destroy (self->input_pool);
+    gst_vpe_teardown (self, (GDestroyNotify) gst_vpe_buffer_pool_destroy,
+        self->input_pool);
     GST_DEBUG_OBJECT (self, "gst_vpe_buffer_pool_destroy(input) done");
   }
   self->input_pool = NULL;
   if (self->output_pool) {
-    gst_vpe_buffer_pool_destroy (self->output_pool);
+    gst_vpe_teardown (self, (GDestroyNotify) gst_vpe_buffer_pool_destroy,
+        self->output_pool);
     GST_DEBUG_OBJECT (self, "gst_vpe_buffer_pool_destroy(output) done");
   }
   self->output_pool = NULL;
-  if (self->video_fd >= 0)
-    close (self->video_fd);
-  self->video_fd = -1;
+  gst_vpe_release_downstream_pool (self);
+  gst_vpe_upload_free (self->upload);
+  self->upload = NULL;
+  if (self->allocator)
+    gst_object_unref (self->allocator);
+  self->allocator = NULL;
+  /* The device outlives us for the grace period, in case another
+   * instance starts soon, and in any case the buffers of our pools */
   if (self->dev)
-    dce_deinit (self->dev);
-  GST_DEBUG_OBJECT (self, "dce_deinit done");
+    gst_vpe_teardown (self, (GDestroyNotify) gst_vpe_device_put, self->dev);
   gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
   self->dev = NULL;
   self->input_width = 0;
@@ -749,12 +2511,134 @@ gst_vpe_destroy (GstVpe * self)
   self->input_crop.c.height = 0;
   self->output_framerate_d = 0;
   self->output_repeat_rate = 1;
-  if (self->device)
-    g_free (self->device);
-  self->device = NULL;
+  self->input_num_planes = 1;
+  self->input_stride[0] = self->input_stride[1] = 0;
+  memset (&self->input_format, 0, sizeof (self->input_format));
+  memset (&self->output_format, 0, sizeof (self->output_format));
 }
 
 
+/* Called from the streaming thread, at a frame boundary, after downstream
+ * asked for a reconfiguration. If the output geometry changes, the frames
+ * already in the driver complete into the current output pool, then only
+ * the CAPTURE queue is restarted with a new pool. The OUTPUT queue keeps
+ * streaming and nothing is drained.
+ */
+static gboolean
+gst_vpe_renegotiate (GstVpe * self)
+{
+  struct v4l2_requestbuffers reqbuf;
+  GstVpeBufferPool *old_pool;
+  GstCaps *caps;
+  gint old_width, old_height;
+  guint32 old_fourcc;
+  gboolean ret = TRUE;
+  gint64 deadline;
+
+  GST_VPE_STATE_LOCK (self);
+  old_width = self->output_width;
+  old_height = self->output_height;
+  old_fourcc = self->output_fourcc;
+  self->fixed_caps = FALSE;
+  if (!gst_vpe_set_output_caps (self)) {
+    GST_VPE_STATE_UNLOCK (self);
+    GST_WARNING_OBJECT (self, "Renegotiation failed, keeping current caps");
+    return FALSE;
+  }
+
+  if (old_width == self->output_width && old_height == self->output_height
+      && old_fourcc == self->output_fourcc) {
+    GST_VPE_STATE_UNLOCK (self);
+    caps = gst_pad_get_current_caps (self->srcpad);
+    if (!caps || !gst_caps_is_equal (caps, self->output_caps))
+      gst_pad_set_caps (self->srcpad, self->output_caps);
+    if (caps)
+      gst_caps_unref (caps);
+    return TRUE;
+  }
+
+  GST_DEBUG_OBJECT (self, "Output changes from %dx%d to %dx%d",
+      old_width, old_height, self->output_width, self->output_height);
+
+  if (self->state != GST_VPE_ST_STREAMING) {
+    /* Streaming is off, the new pool is created when it is turned on */
+    if (self->output_pool) {
+      gst_vpe_output_snapshot (self);
+      gst_vpe_buffer_pool_destroy (self->output_pool);
+      self->output_pool = NULL;
+    }
+    GST_VPE_STATE_UNLOCK (self);
+    gst_pad_set_caps (self->srcpad, self->output_caps);
+    gst_vpe_decide_allocation (self);
+    return TRUE;
+  }
+
+  /* Let the driver finish what it has. The input held back waits for the
+   * new pool, unless the output goes passthrough: it is then processed
+   * first, so that it does not come out after the buffers passed
+   * through */
+  self->reconfiguring = !self->passthrough;
+  deadline = g_get_monotonic_time () + DRAIN_TIMEOUT * G_TIME_SPAN_MILLISECOND;
+  while (self->state == GST_VPE_ST_STREAMING &&
+      (self->output_q_processing != 0 || (self->passthrough &&
+              !g_queue_is_empty (&self->input_q)))) {
+    if (!g_cond_wait_until (&self->dequeue_cond, &self->state_lock,
+            deadline) && g_get_monotonic_time () >= deadline) {
+      GST_ERROR_OBJECT (self, "Driver still holds %d frames after %d ms, "
+          "cannot renegotiate", self->output_q_processing, DRAIN_TIMEOUT);
+      self->reconfiguring = FALSE;
+      GST_VPE_STATE_UNLOCK (self);
+      return FALSE;
+    }
+  }
+  self->reconfiguring = TRUE;
+
+  /* Wait for the last processed frame to be pushed */
+  gst_vpe_push_acquire (self, TRUE);
+  if (self->state == GST_VPE_ST_STREAMING && self->video_fd >= 0) {
+    gst_vpe_output_snapshot (self);
+    old_pool = self->output_pool;
+    self->output_pool = NULL;
+    if (old_pool) {
+      gst_vpe_buffer_pool_set_streaming (old_pool, self->video_fd, FALSE,
+          FALSE);
+      gst_vpe_buffer_pool_destroy (old_pool);
+    }
+    /* The driver refuses S_FMT while it still has buffers allocated */
+    bzero (&reqbuf, sizeof (reqbuf));
+    reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    reqbuf.memory = gst_vpe_v4l2_memory (self, FALSE);
+    if (ioctl (self->video_fd, VIDIOC_REQBUFS, &reqbuf) < 0)
+      GST_WARNING_OBJECT (self, "VIDIOC_REQBUFS(0) for output failed");
+
+    /* Downstream may offer a new pool for the new caps */
+    GST_VPE_STATE_UNLOCK (self);
+    gst_pad_set_caps (self->srcpad, self->output_caps);
+    gst_vpe_decide_allocation (self);
+    GST_VPE_STATE_LOCK (self);
+
+    if (self->state != GST_VPE_ST_STREAMING || self->video_fd < 0) {
+      ret = FALSE;
+    } else if (!gst_vpe_output_set_fmt (self)
+        || !gst_vpe_init_output_buffers (self)) {
+      GST_ERROR_OBJECT (self, "Cannot restart output with the new caps");
+      ret = FALSE;
+    } else {
+      self->output_q_processing = 0;
+      self->early_in_flight = 0;
+      self->frames_queued = self->frames_output = 0;
+      gst_vpe_node_report (self, GST_CLOCK_TIME_NONE);
+      gst_vpe_buffer_pool_set_streaming (self->output_pool, self->video_fd,
+          TRUE, FALSE);
+      gst_vpe_save_config (self);
+    }
+  }
+  self->reconfiguring = FALSE;
+  gst_vpe_push_release (self);
+  GST_VPE_STATE_UNLOCK (self);
+  return ret;
+}
+
 static gboolean
 gst_vpe_activate_mode (GstPad * pad, GstObject * parent,
     GstPadMode mode, gboolean active)
@@ -762,6 +2646,7 @@ gst_vpe_activate_mode (GstPad * pad, GstObject * parent,
   if (mode == GST_PAD_MODE_PUSH) {
     gboolean result = TRUE;
     GstVpe *self;
+    GstTask *task;
     self = GST_VPE (parent);
     GST_DEBUG_OBJECT (self, "gst_vpe_activate_mode (active = %d)", active);
     if (!active) {
@@ -771,6 +2656,15 @@ gst_vpe_activate_mode (GstPad * pad, GstObject * parent,
       result =
           gst_pad_start_task (self->srcpad, gst_vpe_dequeue_loop, self, NULL);
       GST_DEBUG_OBJECT (self, "gst_pad_start_task returned %d", result);
+      GST_OBJECT_LOCK (self->srcpad);
+      task = GST_PAD_TASK (self->srcpad);
+      if (task)
+        gst_object_ref (task);
+      GST_OBJECT_UNLOCK (self->srcpad);
+      if (task) {
+        gst_task_set_leave_callback (task, gst_vpe_task_leave, self, NULL);
+        gst_object_unref (task);
+      }
     }
     return result;
   }
@@ -784,11 +2678,16 @@ gst_vpe_sink_setcaps (GstPad * pad, GstCaps * caps)
   GstStructure *s;
   GstVpe *self = GST_VPE (gst_pad_get_parent (pad));
   if (caps) {
-    GST_OBJECT_LOCK (self);
+    GST_VPE_STATE_LOCK (self);
     if (TRUE == (ret = gst_vpe_parse_input_caps (self, caps))) {
       ret = gst_vpe_set_output_caps (self);
     }
-    GST_OBJECT_UNLOCK (self);
+    /* The dequeue loop sets up the device while upstream is busy with its
+     * first frame */
+    if (ret && self->prewarm && self->state == GST_VPE_ST_INIT
+        && !self->output_pool)
+      self->prewarm_pending = TRUE;
+    GST_VPE_STATE_UNLOCK (self);
 
     if (TRUE == ret) {
       gst_pad_set_caps (self->srcpad, self->output_caps);
@@ -800,17 +2699,41 @@ gst_vpe_sink_setcaps (GstPad * pad, GstCaps * caps)
   return ret;
 }
 
+/* Caps of a pad are the caps of the peer of the other pad, transformed
+ * across the element */
 static GstCaps *
-gst_vpe_getcaps (GstPad * pad)
+gst_vpe_getcaps (GstVpe * self, GstPad * pad, GstCaps * filter)
 {
-  GstCaps *caps = NULL;
-  caps = gst_pad_get_current_caps (pad);
-  if (caps == NULL) {
-    GstCaps *fil = gst_pad_get_pad_template_caps (pad);
-    return fil;
+  GstPad *otherpad = (pad == self->srcpad) ? self->sinkpad : self->srcpad;
+  GstCaps *peerfilter = NULL, *peercaps, *templ, *caps, *tmp;
+
+  templ = gst_pad_get_pad_template_caps (pad);
+  if (filter)
+    peerfilter = gst_vpe_transform_caps (self, GST_PAD_DIRECTION (pad),
+        filter);
+
+  peercaps = gst_pad_peer_query_caps (otherpad, peerfilter);
+  if (peerfilter)
+    gst_caps_unref (peerfilter);
+
+  if (gst_caps_is_any (peercaps)) {
+    caps = gst_caps_ref (templ);
   } else {
-    return caps;
+    tmp = gst_vpe_transform_caps (self, GST_PAD_DIRECTION (otherpad),
+        peercaps);
+    caps = gst_caps_intersect_full (tmp, templ, GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref (tmp);
+  }
+  gst_caps_unref (peercaps);
+  gst_caps_unref (templ);
+
+  if (filter) {
+    tmp = gst_caps_intersect_full (caps, filter, GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref (caps);
+    caps = tmp;
   }
+  GST_LOG_OBJECT (pad, "caps: %" GST_PTR_FORMAT, caps);
+  return caps;
 }
 
 static gboolean
@@ -821,9 +2744,11 @@ gst_vpe_query (GstPad * pad, GstObject * parent, GstQuery * query)
   switch (GST_QUERY_TYPE (query)) {
     case GST_QUERY_CAPS:
     {
-      GstCaps *caps;
-      caps = gst_vpe_getcaps (pad);
+      GstCaps *caps, *filter;
+      gst_query_parse_caps (query, &filter);
+      caps = gst_vpe_getcaps (self, pad, filter);
       gst_query_set_caps_result (query, caps);
+      gst_caps_unref (caps);
       return TRUE;
       break;
     }
@@ -835,24 +2760,39 @@ gst_vpe_query (GstPad * pad, GstObject * parent, GstQuery * query)
       if (caps == NULL)
         return FALSE;
 
-      GST_OBJECT_LOCK (self);
+      GST_VPE_STATE_LOCK (self);
       if (G_UNLIKELY (self->state == GST_VPE_ST_DEINIT)) {
-        GST_OBJECT_UNLOCK (self);
+        GST_VPE_STATE_UNLOCK (self);
         GST_WARNING_OBJECT (self, "Plugin is shutting down, returning FALSE");
         return FALSE;
       }
 
       if (!gst_vpe_init_input_bufs (self, caps)) {
-        GST_OBJECT_UNLOCK (self);
+        GST_VPE_STATE_UNLOCK (self);
         return FALSE;
       }
 
-      gst_query_add_allocation_pool (query,
-          GST_BUFFER_POOL (self->input_pool), 1, 0, self->num_input_buffers);
-
-      gst_query_add_allocation_param (query, gst_drm_allocator_get (), NULL);
+      /* Driver allocated input buffers only exist once streaming */
+      if (self->memory_mode != GST_VPE_MEMORY_MODE_MMAP)
+        gst_query_add_allocation_pool (query,
+            GST_BUFFER_POOL (self->input_pool), 1, 0, self->num_input_buffers);
+
+      if (self->memory_mode == GST_VPE_MEMORY_MODE_DMABUF) {
+        gst_query_add_allocation_param (query, self->allocator ?
+            self->allocator : gst_drm_allocator_get (), NULL);
+      } else if (self->memory_mode == GST_VPE_MEMORY_MODE_USERPTR) {
+        GstAllocationParams params;
+        gst_allocation_params_init (&params);
+        params.align = sysconf (_SC_PAGESIZE) - 1;
+        gst_query_add_allocation_param (query, NULL, &params);
+      }
+      gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+      /* Input fences are waited for before queueing */
+      if (self->fence_mode != GST_VPE_FENCE_NONE)
+        gst_query_add_allocation_meta (query, GST_VPE_FENCE_META_API_TYPE,
+            NULL);
 
-      GST_OBJECT_UNLOCK (self);
+      GST_VPE_STATE_UNLOCK (self);
       gst_caps_unref (caps);
       return TRUE;
       break;
@@ -866,6 +2806,97 @@ gst_vpe_query (GstPad * pad, GstObject * parent, GstQuery * query)
   return gst_pad_query_default (pad, parent, query);
 }
 
+/* Wait until everything received has been processed and pushed */
+static void
+gst_vpe_drain (GstVpe * self)
+{
+  while (1) {
+    GST_VPE_STATE_LOCK (self);
+    if (TRUE != g_queue_is_empty (&self->input_q)) {
+      GST_DEBUG_OBJECT (self,
+          "Buffers to be pushed into the V4L2 driver %d",
+          self->input_q_depth);
+    } else if (0 != self->output_q_processing) {
+      GST_DEBUG_OBJECT (self,
+          "Buffers to be processed by the V4L2 driver %d",
+          self->output_q_processing);
+    } else {
+      GST_VPE_STATE_UNLOCK (self);
+      break;
+    }
+    GST_VPE_STATE_UNLOCK (self);
+    usleep (10000);
+  }
+}
+
+/* Find a held back frame to drop, from the oldest or the newest one.
+ * Frames that others depend on, and the ones marking a discontinuity,
+ * are only picked if there is no better choice.
+ */
+static GList *
+gst_vpe_pick_drop (GstVpe * self, gboolean oldest)
+{
+  GList *l, *any = NULL;
+  GstBuffer *buf;
+
+  for (l = oldest ? self->input_q.head : self->input_q.tail; l;
+      l = oldest ? l->next : l->prev) {
+    buf = (GstBuffer *) l->data;
+    if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DISCONT))
+      continue;
+    if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT))
+      return l;
+    if (!any)
+      any = l;
+  }
+  return any;
+}
+
+/* Apply the drop policy once the frame just received has been held back.
+ * Called with the state lock.
+ */
+static void
+gst_vpe_drop_input (GstVpe * self)
+{
+  GstBuffer *buf = (GstBuffer *) g_queue_peek_tail (&self->input_q);
+  GList *drop = NULL;
+
+  if (self->drop_policy == GST_VPE_DROP_NONE ||
+      g_queue_get_length (&self->input_q) <= MAX_HELD_INPUT) {
+    self->overload_frames = 0;
+    return;
+  }
+  switch (self->drop_policy) {
+    case GST_VPE_DROP_OLDEST:
+      drop = gst_vpe_pick_drop (self, TRUE);
+      break;
+    case GST_VPE_DROP_NEWEST:
+      drop = gst_vpe_pick_drop (self, FALSE);
+      break;
+    case GST_VPE_DROP_KEEP_NTH:
+      if (self->overload_frames++ % MAX (self->keep_every, 1) &&
+          !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DISCONT))
+        drop = self->input_q.tail;
+      else if (g_queue_get_length (&self->input_q) > 2 * MAX_HELD_INPUT)
+        /* Still too far behind, keep the latency bounded */
+        drop = gst_vpe_pick_drop (self, TRUE);
+      break;
+    default:
+      break;
+  }
+  if (drop) {
+    buf = (GstBuffer *) drop->data;
+    GST_LOG_OBJECT (self, "Overloaded, dropping %" GST_TIME_FORMAT,
+        GST_TIME_ARGS (GST_BUFFER_PTS (buf)));
+    g_queue_delete_link (&self->input_q, drop);
+    gst_vpe_buffer_pool_unreserve (self->input_pool, buf);
+    gst_buffer_unref (buf);
+    GST_OBJECT_LOCK (self);
+    self->dropped[self->drop_policy]++;
+    GST_OBJECT_UNLOCK (self);
+  }
+}
+
 static GstFlowReturn
 gst_vpe_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
 {
@@ -874,20 +2905,50 @@ gst_vpe_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
   chains++;
 
   GstVpe *self = GST_VPE (parent);      //creates a typecast of the parent object.
-  gint q_cnt;
   GstVPEBufferPriv *vpe_buf;
 
   GST_DEBUG_OBJECT (self, "chain: %" GST_TIME_FORMAT " ( ptr %p)",
       GST_TIME_ARGS (GST_BUFFER_PTS (buf)), buf);
 
-  GST_OBJECT_LOCK (self);
+  if (self->fence_mode != GST_VPE_FENCE_NONE)
+    gst_vpe_wait_input_fences (self, buf);
+
+  if (self->reverse && GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DISCONT)) {
+    /* The previous chunk of the reverse playback segment is complete */
+    GstFlowReturn ret;
+
+    gst_vpe_drain (self);
+    ret = gst_vpe_push_reverse_chunk (self);
+    if (ret != GST_FLOW_OK) {
+      gst_buffer_unref (buf);
+      return ret;
+    }
+  }
+
+  GST_VPE_STATE_LOCK (self);
+  if (G_UNLIKELY (self->chain_thread != g_thread_self ())) {
+    GST_OBJECT_LOCK (self);
+    self->chain_thread = g_thread_self ();
+    self->chain_clock_valid =
+        pthread_getcpuclockid (pthread_self (), &self->chain_clock) == 0;
+    GST_OBJECT_UNLOCK (self);
+  }
+  if (G_UNLIKELY (self->output_flow != GST_FLOW_OK)) {
+    /* The dequeue loop failed to push */
+    GstFlowReturn ret = self->output_flow;
+
+    GST_VPE_STATE_UNLOCK (self);
+    GST_DEBUG_OBJECT (self, "Output flow %s", gst_flow_get_name (ret));
+    gst_buffer_unref (buf);
+    return ret;
+  }
   if (G_UNLIKELY (self->state != GST_VPE_ST_ACTIVE &&
           self->state != GST_VPE_ST_STREAMING)) {
     printf
         ("gstvpe.c:gst_vpe_chain: entered G_UNLIKELY where the VPE isn't active or streaming\n");
     if (self->state == GST_VPE_ST_DEINIT) {
       printf ("GstVpe.c:gst_vpe_chain: self->state == GST_VPE_ST_DEINIT\n");    //doesn't go here
-      GST_OBJECT_UNLOCK (self);
+      GST_VPE_STATE_UNLOCK (self);
       GST_WARNING_OBJECT (self,
           "Plugin is shutting down, freeing buffer: %p", buf);
       gst_buffer_unref (buf);
@@ -902,23 +2963,64 @@ gst_vpe_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
           self->input_crop.c.height = crop->height;
         }
       }
+      /* Too late to prewarm */
+      self->prewarm_pending = FALSE;
       if (gst_vpe_start (self, gst_pad_get_current_caps (pad))) {       //goes in here, gets input caps??
-        GST_OBJECT_UNLOCK (self);
+        gboolean prewarmed = self->output_pool != NULL;
+        GST_VPE_STATE_UNLOCK (self);
         /* Set output caps, this should be done outside the lock */
         gst_pad_set_caps (self->srcpad, self->output_caps);
-        GST_OBJECT_LOCK (self);
+        if (!prewarmed)
+          gst_vpe_decide_allocation (self);
+        GST_VPE_STATE_LOCK (self);
       } else {
-        GST_OBJECT_UNLOCK (self);
+        GST_VPE_STATE_UNLOCK (self);
         return GST_FLOW_ERROR;
       }
     }
   }
 
+  if (G_UNLIKELY (gst_pad_check_reconfigure (self->srcpad))) {
+    GST_VPE_STATE_UNLOCK (self);
+    if (!gst_vpe_renegotiate (self)) {
+      gst_buffer_unref (buf);
+      return GST_FLOW_NOT_NEGOTIATED;
+    }
+    GST_VPE_STATE_LOCK (self);
+  }
+
   if (self->passthrough) {
-    GST_OBJECT_UNLOCK (self);
+    GST_VPE_STATE_UNLOCK (self);
     GST_DEBUG_OBJECT (self, "Passthrough for VPE");
     return gst_pad_push (self->srcpad, buf);
   }
+  if ((self->segment.flags & GST_SEGMENT_FLAG_TRICKMODE_KEY_UNITS) &&
+      GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    GST_VPE_STATE_UNLOCK (self);
+    GST_LOG_OBJECT (self, "Key units only, dropping %p", buf);
+    gst_buffer_unref (buf);
+    return GST_FLOW_OK;
+  }
+  if (self->memory_mode == GST_VPE_MEMORY_MODE_MMAP &&
+      G_UNLIKELY (self->state != GST_VPE_ST_STREAMING)) {
+    /* The driver buffers the input is copied into exist once streaming */
+    self->input_num_planes = 1;
+    if (!gst_vpe_set_streaming (self, TRUE))
+      goto streaming_failed;
+    self->state = GST_VPE_ST_STREAMING;
+  }
+
+  if (!gst_vpe_input_importable (self, buf)) {
+    GST_LOG_OBJECT (self, "Copying input buffer %p", buf);
+    buf = gst_vpe_upload_input (self, buf);
+    if (!buf || self->state == GST_VPE_ST_DEINIT) {
+      GST_VPE_STATE_UNLOCK (self);
+      if (buf)
+        gst_buffer_unref (buf);
+      return buf ? GST_FLOW_OK : GST_FLOW_ERROR;
+    }
+  }
+
   //fails to get vpe_buf
   vpe_buf = gst_buffer_get_vpe_buffer_priv (self->input_pool, buf);     //likely because it fails to get the input_pool? yes.  returns here on second chain call
   if (!vpe_buf) {
@@ -937,32 +3039,71 @@ gst_vpe_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
 
   if (vpe_buf) {
     if (G_UNLIKELY (self->state != GST_VPE_ST_STREAMING)) {
-      gst_vpe_set_streaming (self, TRUE);
+      gst_vpe_set_input_layout (self, buf);
+      if (!gst_vpe_set_streaming (self, TRUE))
+        goto streaming_failed;
       self->state = GST_VPE_ST_STREAMING;
     }
-    printf ("MAX_INPUT_Q_DEPTH = 12, self->input_q_depth = %d\n",
-        self->input_q_depth);
-    if ((MAX_INPUT_Q_DEPTH - self->input_q_depth) >= 1) {       //input q depth = 8?  actually it's 0
+    GST_LOG_OBJECT (self, "input_q_max = %d, input_q_depth = %d",
+        self->input_q_max, self->input_q_depth);
+    /* Buffers already held back go first */
+    if (g_queue_is_empty (&self->input_q)
+        && gst_vpe_can_queue_input (self, buf)) {
       GST_DEBUG_OBJECT (self, "Push the buffer into the V4L2 driver %d",
           self->input_q_depth);
-      if (TRUE != gst_vpe_buffer_pool_queue (self->input_pool, buf, &q_cnt)) {
-        GST_OBJECT_UNLOCK (self);
+      if (TRUE != gst_vpe_queue_input (self, buf)) {
+        GST_VPE_STATE_UNLOCK (self);
         return GST_FLOW_ERROR;
       }
-      self->input_q_depth += q_cnt;
-      if (self->interlaced) {
-        self->output_q_processing += q_cnt * 2;
-      } else {
-        self->output_q_processing += q_cnt;
-      }
     } else {
+      if (self->input_q_depth >= self->input_q_max)
+        self->auto_waits++;
       g_queue_push_tail (&self->input_q, (gpointer) buf);
+      gst_vpe_drop_input (self);
     }
   }
-  GST_OBJECT_UNLOCK (self);
+  if (self->latency_mode == GST_VPE_LATENCY_LOW && !self->reverse) {
+    GstFlowReturn ret;
+
+    gst_vpe_push_acquire (self, TRUE);
+    GST_VPE_STATE_UNLOCK (self);
+    ret = gst_vpe_push_early (self);
+    if (ret == GST_FLOW_OK)
+      ret = gst_vpe_push_output_sync (self);
+    GST_VPE_STATE_LOCK (self);
+    gst_vpe_push_release (self);
+    GST_VPE_STATE_UNLOCK (self);
+    return ret;
+  }
+  if (self->fence_mode == GST_VPE_FENCE_EARLY &&
+      gst_vpe_push_acquire (self, FALSE)) {
+    GstFlowReturn ret;
+
+    GST_VPE_STATE_UNLOCK (self);
+    ret = gst_vpe_push_early (self);
+    GST_VPE_STATE_LOCK (self);
+    gst_vpe_push_release (self);
+    GST_VPE_STATE_UNLOCK (self);
+    if (ret != GST_FLOW_OK)
+      return ret;
+  } else {
+    GST_VPE_STATE_UNLOCK (self);
+  }
   /* Allow dequeue thread to run */
   sched_yield ();
   return GST_FLOW_OK;
+
+streaming_failed:
+  {
+    GstFlowReturn ret = self->state == GST_VPE_ST_DEINIT ?
+        GST_FLOW_FLUSHING : GST_FLOW_ERROR;
+
+    GST_VPE_STATE_UNLOCK (self);
+    if (ret == GST_FLOW_ERROR)
+      GST_ERROR_OBJECT (self, "Cannot start streaming");
+    gst_buffer_unref (buf);
+    return ret;
+  }
 }
 
 static gboolean
@@ -982,51 +3123,79 @@ gst_vpe_event (GstPad * pad, GstObject * parent, GstEvent * event)
     }
     case GST_EVENT_SEGMENT:
     {
+      gboolean trickmode, reverse;
+
       gst_event_copy_segment (event, &self->segment);
+      trickmode = (self->segment.flags & (GST_SEGMENT_FLAG_TRICKMODE |
+              GST_SEGMENT_FLAG_TRICKMODE_KEY_UNITS |
+              GST_SEGMENT_FLAG_TRICKMODE_NO_AUDIO)) != 0;
+      GST_VPE_STATE_LOCK (self);
+      if (trickmode != self->trickmode) {
+        GST_DEBUG_OBJECT (self, "Trick mode %s", trickmode ? "on" : "off");
+        if (self->state == GST_VPE_ST_STREAMING) {
+          /* Without a flush, finish the frames of the previous segment
+           * and restart with the new input format */
+          GST_VPE_STATE_UNLOCK (self);
+          gst_vpe_drain (self);
+          GST_VPE_STATE_LOCK (self);
+          gst_vpe_set_streaming (self, FALSE);
+          self->state = GST_VPE_ST_INIT;
+        }
+        self->trickmode = trickmode;
+        if (self->trickmode_scale > 1)
+          gst_pad_mark_reconfigure (self->srcpad);
+      }
+      GST_VPE_STATE_UNLOCK (self);
+
+      reverse = self->reverse_reorder &&
+          self->segment.format == GST_FORMAT_TIME &&
+          self->segment.rate < (gdouble) 0.0;
+      if (self->reverse && !reverse) {
+        gst_vpe_drain (self);
+        gst_vpe_push_reverse_chunk (self);
+      }
+      GST_VPE_STATE_LOCK (self);
+      if (reverse != self->reverse && self->trickmode_scale > 1)
+        gst_pad_mark_reconfigure (self->srcpad);
+      self->reverse = reverse;
+      GST_VPE_STATE_UNLOCK (self);
 
-      if (self->segment.format == GST_FORMAT_TIME &&
+      if (!self->reverse_reorder && self->segment.format == GST_FORMAT_TIME &&
           self->segment.rate < (gdouble) 0.0) {
-        GST_OBJECT_LOCK (self);
+        GST_VPE_STATE_LOCK (self);
         /* In case of reverse playback, more input buffers
            are required */
         if (!gst_vpe_init_input_bufs (self, NULL)) {
           GST_ERROR_OBJECT (self, "gst_vpe_init_input_bufs failed");
         }
-        GST_OBJECT_UNLOCK (self);
+        GST_VPE_STATE_UNLOCK (self);
       }
     }
       break;
 
     case GST_EVENT_EOS:
-      while (1) {
-        GST_OBJECT_LOCK (self);
-        if (TRUE != g_queue_is_empty (&self->input_q)) {
-          GST_DEBUG_OBJECT (self,
-              "Buffers to be pushed into the V4L2 driver %d",
-              self->input_q_depth);
-        } else if (0 != self->output_q_processing) {
-          GST_DEBUG_OBJECT (self,
-              "Buffers to be processed by the V4L2 driver %d",
-              self->output_q_processing);
-        } else {
-          GST_OBJECT_UNLOCK (self);
-          GST_DEBUG_OBJECT (self, "VPE ready for EOS");
-          break;
-        }
-        GST_OBJECT_UNLOCK (self);
-        usleep (10000);
-      }
+      gst_vpe_drain (self);
+      GST_VPE_STATE_LOCK (self);
+      if (self->node)
+        gst_vpe_node_idle (self->node, self);
+      GST_VPE_STATE_UNLOCK (self);
+      if (self->reverse)
+        gst_vpe_push_reverse_chunk (self);
+      GST_DEBUG_OBJECT (self, "VPE ready for EOS");
       break;
     case GST_EVENT_FLUSH_STOP:
-      GST_OBJECT_LOCK (self);
+      GST_VPE_STATE_LOCK (self);
       self->state = GST_VPE_ST_INIT;
-      GST_OBJECT_UNLOCK (self);
+      self->output_flow = GST_FLOW_OK;
+      GST_VPE_STATE_UNLOCK (self);
       break;
     case GST_EVENT_FLUSH_START:
-      GST_OBJECT_LOCK (self);
+      GST_VPE_STATE_LOCK (self);
+      g_queue_foreach (&self->reverse_q, (GFunc) gst_buffer_unref, NULL);
+      g_queue_clear (&self->reverse_q);
       gst_vpe_set_streaming (self, FALSE);
       self->state = GST_VPE_ST_DEINIT;
-      GST_OBJECT_UNLOCK (self);
+      GST_VPE_STATE_UNLOCK (self);
       break;
     default:
       break;
@@ -1048,6 +3217,12 @@ gst_vpe_src_event (GstPad * pad, GstObject * parent, GstEvent * event)
       // TODO or not!!
       ret = gst_pad_push_event (self->sinkpad, event);
       break;
+    case GST_EVENT_RECONFIGURE:
+      /* The srcpad is flagged, the output is renegotiated from the
+       * streaming thread with the next buffer */
+      GST_DEBUG_OBJECT (self, "Downstream requested reconfiguration");
+      ret = gst_pad_push_event (self->sinkpad, event);
+      break;
     default:
       ret = gst_pad_push_event (self->sinkpad, event);
       break;
@@ -1068,10 +3243,18 @@ gst_vpe_change_state (GstElement * element, GstStateChange transition)
           (transition)),
       gst_element_state_get_name (GST_STATE_TRANSITION_NEXT (transition)));
   switch (transition) {
+    case GST_STATE_CHANGE_NULL_TO_READY:
     case GST_STATE_CHANGE_READY_TO_PAUSED:
-      GST_OBJECT_LOCK (self);
-      self->state = GST_VPE_ST_INIT;
-      GST_OBJECT_UNLOCK (self);
+      GST_VPE_STATE_LOCK (self);
+      if (transition == GST_STATE_CHANGE_READY_TO_PAUSED)
+        self->state = GST_VPE_ST_INIT;
+      /* Open the devices ahead of the caps */
+      if (self->prewarm && (!gst_vpe_create (self)
+              || !gst_vpe_open_device (self))) {
+        GST_VPE_STATE_UNLOCK (self);
+        return GST_STATE_CHANGE_FAILURE;
+      }
+      GST_VPE_STATE_UNLOCK (self);
       break;
     default:
       break;
@@ -1083,11 +3266,17 @@ gst_vpe_change_state (GstElement * element, GstStateChange transition)
     goto leave;
   switch (transition) {
     case GST_STATE_CHANGE_PAUSED_TO_READY:
-      GST_OBJECT_LOCK (self);
+      GST_VPE_STATE_LOCK (self);
       gst_vpe_set_streaming (self, FALSE);
       self->state = GST_VPE_ST_DEINIT;
       gst_vpe_destroy (self);
-      GST_OBJECT_UNLOCK (self);
+      GST_VPE_STATE_UNLOCK (self);
+      break;
+    case GST_STATE_CHANGE_READY_TO_NULL:
+      /* Devices opened by prewarm */
+      GST_VPE_STATE_LOCK (self);
+      gst_vpe_destroy (self);
+      GST_VPE_STATE_UNLOCK (self);
       break;
     default:
       break;
@@ -1112,7 +3301,104 @@ gst_vpe_get_property (GObject * obj,
       g_value_set_int (value, self->num_output_buffers);
       break;
     case PROP_DEVICE:
+      GST_OBJECT_LOCK (self);
       g_value_set_string (value, self->device);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_ADD_BORDERS:
+      g_value_set_boolean (value, self->add_borders);
+      break;
+    case PROP_MEMORY_MODE:
+      g_value_set_enum (value, self->memory_mode);
+      break;
+    case PROP_ALLOCATOR:
+      g_value_set_enum (value, self->allocator_type);
+      break;
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint64 (value, gst_vpe_memory_get_budget ());
+      break;
+    case PROP_MEMORY_USAGE:
+      g_value_set_uint64 (value, gst_vpe_memory_get_usage (NULL));
+      break;
+    case PROP_DEVICE_GRACE_PERIOD:
+      g_value_set_uint (value, gst_vpe_device_get_grace_period ());
+      break;
+    case PROP_PREWARM:
+      g_value_set_boolean (value, self->prewarm);
+      break;
+    case PROP_DEVICE_POOL:
+      GST_OBJECT_LOCK (self);
+      g_value_set_string (value, self->device_pool);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_PRIORITY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->priority);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_TARGET_FRAMERATE:
+      GST_OBJECT_LOCK (self);
+      gst_value_set_fraction (value, self->target_framerate_n,
+          self->target_framerate_d);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_DROP_POLICY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_enum (value, self->drop_policy);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_KEEP_EVERY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->keep_every);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_TRICKMODE_SCALE:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->trickmode_scale);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_REVERSE_REORDER:
+      g_value_set_boolean (value, self->reverse_reorder);
+      break;
+    case PROP_LATENCY_MODE:
+      GST_OBJECT_LOCK (self);
+      g_value_set_enum (value, self->latency_mode);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_INPUT_QUEUE_DEPTH:
+      GST_OBJECT_LOCK (self);
+      g_value_set_int (value, self->input_queue_depth);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_TASK_PRIORITY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_int (value, self->task_priority);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_TASK_POLICY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_enum (value, self->task_policy);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_CPU_AFFINITY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->cpu_affinity);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_FENCE_MODE:
+      GST_OBJECT_LOCK (self);
+      g_value_set_enum (value, self->fence_mode);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_ASYNC_TEARDOWN:
+      GST_OBJECT_LOCK (self);
+      g_value_set_boolean (value, self->async_teardown);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_STATS:
+      GST_OBJECT_LOCK (self);
+      g_value_take_boxed (value, gst_vpe_get_stats (self));
+      GST_OBJECT_UNLOCK (self);
       break;
     default:
     {
@@ -1135,8 +3421,103 @@ gst_vpe_set_property (GObject * obj,
       self->num_output_buffers = g_value_get_int (value);
       break;
     case PROP_DEVICE:
+      GST_OBJECT_LOCK (self);
       g_free (self->device);
       self->device = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_ADD_BORDERS:
+      self->add_borders = g_value_get_boolean (value);
+      break;
+    case PROP_MEMORY_MODE:
+      self->memory_mode = g_value_get_enum (value);
+      break;
+    case PROP_ALLOCATOR:
+      self->allocator_type = g_value_get_enum (value);
+      break;
+    case PROP_MEMORY_BUDGET:
+      gst_vpe_memory_set_budget (g_value_get_uint64 (value));
+      break;
+    case PROP_DEVICE_GRACE_PERIOD:
+      gst_vpe_device_set_grace_period (g_value_get_uint (value));
+      break;
+    case PROP_PREWARM:
+      self->prewarm = g_value_get_boolean (value);
+      break;
+    case PROP_DEVICE_POOL:
+      GST_OBJECT_LOCK (self);
+      g_free (self->device_pool);
+      self->device_pool = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_PRIORITY:
+      GST_OBJECT_LOCK (self);
+      self->priority = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      g_atomic_int_set (&self->schedule_changed, TRUE);
+      break;
+    case PROP_TARGET_FRAMERATE:
+      GST_OBJECT_LOCK (self);
+      self->target_framerate_n = gst_value_get_fraction_numerator (value);
+      self->target_framerate_d = gst_value_get_fraction_denominator (value);
+      GST_OBJECT_UNLOCK (self);
+      g_atomic_int_set (&self->schedule_changed, TRUE);
+      break;
+    case PROP_DROP_POLICY:
+      GST_OBJECT_LOCK (self);
+      self->drop_policy = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_KEEP_EVERY:
+      GST_OBJECT_LOCK (self);
+      self->keep_every = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_TRICKMODE_SCALE:
+      GST_OBJECT_LOCK (self);
+      self->trickmode_scale = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_REVERSE_REORDER:
+      self->reverse_reorder = g_value_get_boolean (value);
+      break;
+    case PROP_LATENCY_MODE:
+      GST_OBJECT_LOCK (self);
+      self->latency_mode = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_INPUT_QUEUE_DEPTH:
+      GST_OBJECT_LOCK (self);
+      self->input_queue_depth = g_value_get_int (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_TASK_PRIORITY:
+      GST_OBJECT_LOCK (self);
+      self->task_priority = g_value_get_int (value);
+      GST_OBJECT_UNLOCK (self);
+      g_atomic_int_set (&self->task_sched_changed, TRUE);
+      break;
+    case PROP_TASK_POLICY:
+      GST_OBJECT_LOCK (self);
+      self->task_policy = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (self);
+      g_atomic_int_set (&self->task_sched_changed, TRUE);
+      break;
+    case PROP_CPU_AFFINITY:
+      GST_OBJECT_LOCK (self);
+      self->cpu_affinity = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      g_atomic_int_set (&self->task_sched_changed, TRUE);
+      break;
+    case PROP_FENCE_MODE:
+      GST_OBJECT_LOCK (self);
+      self->fence_mode = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_ASYNC_TEARDOWN:
+      GST_OBJECT_LOCK (self);
+      self->async_teardown = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (self);
       break;
     default:
     {
@@ -1150,9 +3531,15 @@ static void
 gst_vpe_finalize (GObject * obj)
 {
   GstVpe *self = GST_VPE (obj);
-  GST_OBJECT_LOCK (self);
+  GST_VPE_STATE_LOCK (self);
   gst_vpe_destroy (self);
-  GST_OBJECT_UNLOCK (self);
+  GST_VPE_STATE_UNLOCK (self);
+  g_free (self->device);
+  g_free (self->device_pool);
+  g_free (self->reap_node);
+  g_mutex_clear (&self->state_lock);
+  g_cond_clear (&self->dequeue_cond);
+  g_cond_clear (&self->push_cond);
   G_OBJECT_CLASS (parent_class)->finalize (obj);
 }
 
@@ -1195,12 +3582,135 @@ gst_vpe_class_init (GstVpeClass * klass)
           "Number of output buffers that are allocated and used by this plugin.",
           "The number if output buffers allocated should be specified based on "
           "the downstream element's requirement. It is generally set to the minimum "
-          "value acceptable to the downstream element to reduce memory usage.",
-          3, MAX_NUM_OUTBUFS,
+          "value acceptable to the downstream element to reduce memory usage. "
+          "0 sizes it from the needs of downstream, at each caps change",
+          0, MAX_NUM_OUTBUFS,
           DEFAULT_NUM_OUTBUFS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
   g_object_class_install_property (gobject_class, PROP_DEVICE,
       g_param_spec_string ("device", "Device", "Device location",
           DEFAULT_DEVICE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ADD_BORDERS,
+      g_param_spec_boolean ("add-borders", "Add borders",
+          "Preserve the display aspect ratio of the input by scaling it into "
+          "a centered rectangle of the output frame and filling the rest "
+          "with black borders", DEFAULT_ADD_BORDERS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Processing statistics of the current stream. upload-time is the "
+          "time spent copying the last system memory frame into a dmabuf, "
+          "in nanoseconds", GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MEMORY_MODE,
+      g_param_spec_enum ("memory-mode", "Memory mode",
+          "How buffers are shared with the driver. mmap and userptr do not "
+          "need omap_drm", GST_TYPE_VPE_MEMORY_MODE, DEFAULT_MEMORY_MODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ALLOCATOR,
+      g_param_spec_enum ("allocator", "Allocator",
+          "Where the buffers allocated by the element come from. dma-heap "
+          "and udmabuf do not need omap_drm", GST_TYPE_VPE_ALLOCATOR,
+          DEFAULT_ALLOCATOR, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MEMORY_BUDGET,
+      g_param_spec_uint64 ("memory-budget", "Memory budget",
+          "Bytes of buffer memory all the vpe instances of the process may "
+          "use together (0 = unlimited). Over the budget, input is held back "
+          "and fewer output buffers are allocated", 0, G_MAXUINT64,
+          DEFAULT_MEMORY_BUDGET, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MEMORY_USAGE,
+      g_param_spec_uint64 ("memory-usage", "Memory usage",
+          "Bytes of buffer memory used by all the vpe instances of the "
+          "process", 0, G_MAXUINT64, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DEVICE_GRACE_PERIOD,
+      g_param_spec_uint ("device-grace-period", "Device grace period",
+          "Milliseconds the omap device shared by all the vpe instances of "
+          "the process is kept after the last one stops using it",
+          0, G_MAXUINT, DEFAULT_DEVICE_GRACE_PERIOD,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PREWARM,
+      g_param_spec_boolean ("prewarm", "Prewarm",
+          "Open the device when going to READY, and set up the formats and "
+          "output buffers as soon as the caps are known instead of on the "
+          "first buffer", DEFAULT_PREWARM,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DEVICE_POOL,
+      g_param_spec_string ("device-pool", "Device pool",
+          "Comma separated list of VPE devices. If set, each stream uses the "
+          "least loaded one instead of device", DEFAULT_DEVICE_POOL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PRIORITY,
+      g_param_spec_uint ("priority", "Priority",
+          "Priority of the stream over the others sharing its device, "
+          "higher goes first", 0, G_MAXUINT, DEFAULT_PRIORITY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TARGET_FRAMERATE,
+      gst_param_spec_fraction ("target-framerate", "Target framerate",
+          "Input frames per second the stream needs processed to meet its "
+          "deadlines, 0/1 for the input framerate", 0, 1, G_MAXINT, 1, 0, 1,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DROP_POLICY,
+      g_param_spec_enum ("drop-policy", "Drop policy",
+          "Frames to drop when the device cannot keep up with the input",
+          GST_TYPE_VPE_DROP_POLICY, DEFAULT_DROP_POLICY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_KEEP_EVERY,
+      g_param_spec_uint ("keep-every", "Keep every",
+          "Frames kept out of the ones received while overloaded, with "
+          "drop-policy=keep-every-nth", 1, G_MAXUINT, DEFAULT_KEEP_EVERY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TRICKMODE_SCALE,
+      g_param_spec_uint ("trickmode-scale", "Trick mode scale",
+          "Divide the output width and height by this in trick mode, if "
+          "downstream accepts it", 1, 16, DEFAULT_TRICKMODE_SCALE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_REVERSE_REORDER,
+      g_param_spec_boolean ("reverse-reorder", "Reverse reorder",
+          "In reverse playback, process the frames as they arrive and hold "
+          "the output frames of each chunk for reordering, instead of "
+          "needing upstream to hold the decoded frames",
+          DEFAULT_REVERSE_REORDER,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_LATENCY_MODE,
+      g_param_spec_enum ("latency-mode", "Latency mode",
+          "In low latency mode, the fewest buffers are used and each frame "
+          "is pushed as soon as it is processed, from the streaming thread",
+          GST_TYPE_VPE_LATENCY_MODE, DEFAULT_LATENCY_MODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_INPUT_QUEUE_DEPTH,
+      g_param_spec_int ("input-queue-depth", "Input queue depth",
+          "Buffers queued in the driver at most, 0 to tune it from the "
+          "device occupancy", 0, MAX_INPUT_Q_DEPTH,
+          DEFAULT_INPUT_QUEUE_DEPTH,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TASK_PRIORITY,
+      g_param_spec_int ("task-priority", "Task priority",
+          "Real-time priority of the thread pushing the output frames, "
+          "0 to keep the scheduling it was given", 0, 99, DEFAULT_TASK_PRIORITY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TASK_POLICY,
+      g_param_spec_enum ("task-policy", "Task policy",
+          "Real-time policy used with task-priority",
+          GST_TYPE_VPE_TASK_POLICY, DEFAULT_TASK_POLICY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_CPU_AFFINITY,
+      g_param_spec_uint ("cpu-affinity", "CPU affinity",
+          "Mask of the CPUs the thread pushing the output frames runs on, "
+          "0 to keep the CPUs it was given", 0, G_MAXUINT, DEFAULT_CPU_AFFINITY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_FENCE_MODE,
+      g_param_spec_enum ("fence-mode", "Fence mode",
+          "Wait for the fences of the input, and push the output before the "
+          "VPE is done with it, with a GstVpeFenceMeta to wait on, if "
+          "downstream asks for the meta in the allocation query",
+          GST_TYPE_VPE_FENCE_MODE, DEFAULT_FENCE_MODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ASYNC_TEARDOWN,
+      g_param_spec_boolean ("async-teardown", "Async teardown",
+          "Free the buffers and close the device from a background thread, "
+          "so that stopping returns at once", DEFAULT_ASYNC_TEARDOWN,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  gst_vpe_device_set_grace_period (DEFAULT_DEVICE_GRACE_PERIOD);
 }
 
 static void
@@ -1221,16 +3731,20 @@ gst_vpe_init (GstVpe * self, gpointer klass)
   self->input_width = 0;
   self->input_height = 0;
   self->input_max_ref_frames = 0;
+  self->input_num_planes = 1;
   self->input_crop.c.top = 0;
   self->input_crop.c.left = 0;
   self->input_crop.c.width = 0;
   self->input_crop.c.height = 0;
   self->input_crop.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
   self->interlaced = FALSE;
+  self->deinterlace = FALSE;
   self->state = GST_VPE_ST_INIT;
   self->passthrough = TRUE;
   self->input_pool = NULL;
   self->output_pool = NULL;
+  self->downstream_pool = NULL;
+  self->upload = NULL;
   self->dev = NULL;
   self->video_fd = -1;
   self->input_caps = NULL;
@@ -1240,10 +3754,62 @@ gst_vpe_init (GstVpe * self, gpointer klass)
   self->num_output_buffers = DEFAULT_NUM_OUTBUFS;
   self->output_framerate_d = 0;
   self->output_repeat_rate = 1;
+  self->input_par_n = self->input_par_d = 1;
+  self->output_par_n = self->output_par_d = 1;
+  self->add_borders = DEFAULT_ADD_BORDERS;
+  self->memory_mode = DEFAULT_MEMORY_MODE;
+  self->allocator_type = DEFAULT_ALLOCATOR;
+  self->prewarm = DEFAULT_PREWARM;
+  self->allocator = NULL;
   self->device = g_strdup (DEFAULT_DEVICE);
+  self->device_pool = g_strdup (DEFAULT_DEVICE_POOL);
+  self->node = NULL;
+  self->reap_node = NULL;
+  self->last_output_time = GST_CLOCK_TIME_NONE;
+  self->priority = DEFAULT_PRIORITY;
+  self->target_framerate_n = 0;
+  self->target_framerate_d = 1;
+  self->drop_policy = DEFAULT_DROP_POLICY;
+  self->keep_every = DEFAULT_KEEP_EVERY;
+  self->trickmode = FALSE;
+  self->trickmode_scale = DEFAULT_TRICKMODE_SCALE;
+  self->reverse_reorder = DEFAULT_REVERSE_REORDER;
+  self->reverse = FALSE;
+  g_queue_init (&self->reverse_q);
+  self->latency_mode = DEFAULT_LATENCY_MODE;
+  self->input_queue_depth = DEFAULT_INPUT_QUEUE_DEPTH;
+  self->task_priority = DEFAULT_TASK_PRIORITY;
+  self->task_policy = DEFAULT_TASK_POLICY;
+  self->cpu_affinity = DEFAULT_CPU_AFFINITY;
+  self->fence_mode = DEFAULT_FENCE_MODE;
+  self->async_teardown = DEFAULT_ASYNC_TEARDOWN;
+  self->config.valid = FALSE;
+  self->config.input_caps = self->config.output_caps = NULL;
+  self->restarts = self->cached_restarts = 0;
+  g_queue_init (&self->early_q);
+  self->early_in_flight = 0;
+  self->early_frames = 0;
+  self->task_sched_changed = FALSE;
+  self->schedule_changed = FALSE;
+  self->output_buffers = 0;
+  self->task_thread = self->chain_thread = NULL;
+  self->task_saved = FALSE;
+  self->task_clock_valid = self->chain_clock_valid = FALSE;
+  self->task_cpu_time = self->chain_cpu_time = 0;
+  self->downstream_min = 0;
+  self->downstream_fences = FALSE;
+  self->output_hold_time = 0;
+  self->input_q_max = START_INPUT_Q_DEPTH;
+  self->frames_queued = self->frames_output = 0;
+  g_mutex_init (&self->state_lock);
+  g_cond_init (&self->dequeue_cond);
+  g_cond_init (&self->push_cond);
+  self->pushing = FALSE;
+  self->output_flow = GST_FLOW_OK;
   g_queue_init (&self->input_q);
   self->input_q_depth = 0;
   self->output_q_processing = 0;
+  self->reconfiguring = FALSE;
   gst_segment_init (&self->segment, GST_FORMAT_UNDEFINED);
 }
 
@@ -22,6 +22,8 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
 
 #include <stdint.h>
 #include <stddef.h>
@@ -31,6 +33,7 @@
 #include <gst/video/video.h>
 #include <gst/video/gstvideometa.h>
 #include <gst/drm/gstdrmallocator.h>
+#include <gst/allocators/allocators.h>
 
 #include <linux/videodev2.h>
 #include <linux/v4l2-controls.h>
@@ -54,6 +57,19 @@ G_BEGIN_DECLS GST_DEBUG_CATEGORY_EXTERN (gst_vpe_debug);
 */
 #define MAX_INPUT_Q_DEPTH   12
 
+/* Bounds of the input queue depth when it is tuned automatically, and the
+   number of frames between two adjustments */
+#define MIN_INPUT_Q_DEPTH   2
+#define START_INPUT_Q_DEPTH 4
+#define AUTO_DEPTH_WINDOW   32
+
+/* Number of input buffers held back, waiting for room in the driver,
+   above which the drop policy applies */
+#define MAX_HELD_INPUT      2
+
+/* Frames whose QBUF time is remembered to measure the latency */
+#define LATENCY_RING        32
+
 #define GST_TYPE_VPE               (gst_vpe_get_type())
 #define GST_VPE(obj)               (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_VPE, GstVpe))
 #define GST_VPE_CLASS(klass)       (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_VPE, GstVpeClass))
@@ -62,6 +78,47 @@ G_BEGIN_DECLS GST_DEBUG_CATEGORY_EXTERN (gst_vpe_debug);
 #define GST_VPE_GET_CLASS(obj)     (G_TYPE_INSTANCE_GET_CLASS((obj), GST_TYPE_VPE, GstVpeClass))
 
 typedef struct _GstVpe GstVpe;
+
+typedef enum
+{
+  GST_VPE_MEMORY_MODE_DMABUF,
+  GST_VPE_MEMORY_MODE_MMAP,
+  GST_VPE_MEMORY_MODE_USERPTR,
+} GstVpeMemoryMode;
+
+typedef enum
+{
+  GST_VPE_DROP_NONE,
+  GST_VPE_DROP_OLDEST,
+  GST_VPE_DROP_NEWEST,
+  GST_VPE_DROP_KEEP_NTH,
+  GST_VPE_DROP_POLICY_LAST,
+} GstVpeDropPolicy;
+
+typedef enum
+{
+  GST_VPE_LATENCY_NORMAL,
+  GST_VPE_LATENCY_LOW,
+} GstVpeLatencyMode;
+
+typedef enum
+{
+  GST_VPE_TASK_POLICY_FIFO,
+  GST_VPE_TASK_POLICY_RR,
+} GstVpeTaskPolicy;
+
+typedef enum
+{
+  GST_VPE_FENCE_NONE,
+  GST_VPE_FENCE_WAIT,
+  GST_VPE_FENCE_EARLY,
+} GstVpeFenceMode;
+
+/* How long input waits for the fences of upstream, in ms */
+#define FENCE_TIMEOUT       100
+
+GType gst_vpe_latency_mode_get_type (void);
+#define GST_TYPE_VPE_LATENCY_MODE (gst_vpe_latency_mode_get_type ())
 typedef struct _GstVpeClass GstVpeClass;
 
 
@@ -85,6 +142,10 @@ struct _GstVpeBufferPool
   gboolean interlaced;          /* Whether input is interlaced */
   gint video_fd;                /* a dup(2) of the v4l2object's video_fd */
   guint32 v4l2_type;
+  guint32 memory;               /* V4L2_MEMORY_DMABUF, _MMAP or _USERPTR */
+  gint reqbuf_count;            /* Number of buffers requested from the driver */
+  GstAllocator *allocator;      /* NULL for the omap DRM allocator */
+  gboolean overcommit;          /* Allocate even over the memory budget */
   struct v4l2_format *format;    /* Keep a reference to the current format associated to this pool */
   guint buffer_count, min_buffer_count, max_buffer_count;
   guint32 last_field_pushed;    /* Was the last field sent to the dirver top of bottom */
@@ -95,10 +156,15 @@ struct _GstVpeBufferPool
     GstBuffer *buf;             /* Buffers that are part of this pool */
     gint state;                 /* state of the buffer, FREE, ALLOCATED, WITH_DRIVER */
     gint q_cnt;                 /* Number of times this buffer is queued into the driver */
+    gsize pinned;               /* Bytes accounted while an imported buffer is queued */
+    GstClockTime out_time;      /* When an output buffer left the driver, 0 if it did not */
   } *buf_tracking;
   gint free_head;               /* Head pointer to a free index */
   guint8 index_map[MAX_REQBUF_CNT];
   GHashTable *vpebufferpriv;
+  GstClockTime hold_time;       /* Moving average of the time output buffers are kept downstream */
+  GQueue ready;                 /* Output buffers dequeued, not acquired yet */
+  GQueue queued;                /* Output buffers with the driver, in QBUF order */
 };
 
 struct _GstVpeBufferPoolClass
@@ -118,6 +184,7 @@ struct _GstVpeBufferPoolClass
 typedef struct
 {
   int size;
+  gsize accounted;              /* Bytes allocated by us, counted against the memory budget */
   struct omap_bo *bo;
   struct v4l2_buffer v4l2_buf;
   struct v4l2_plane v4l2_planes[2];
@@ -133,14 +200,126 @@ GstVPEBufferPriv * gst_vpe_buffer_priv (GstVpeBufferPool * pool, struct omap_dev
 
 GstVPEBufferPriv *gst_buffer_get_vpe_buffer_priv (GstVpeBufferPool * pool, GstBuffer * buf);
 
+gint gst_vpe_buffer_num_planes (guint32 fourcc, gint height, GstBuffer * buf);
+
 GstBuffer *gst_vpe_buffer_new (GstVpeBufferPool * pool, struct omap_device *dev,
     guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type);
 
+GstBuffer *gst_vpe_buffer_export (GstVpeBufferPool * pool, struct omap_device *dev,
+    guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type);
+
 GstBuffer *gst_vpe_buffer_import (GstVpeBufferPool * pool, struct omap_device *dev,
     guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type, GstBuffer * buf);
 
+GstBuffer *gst_vpe_buffer_wrap (GstVpeBufferPool * pool, struct omap_device *dev,
+    guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type, GstBuffer * parent);
+
 GstBuffer *gst_vpe_buffer_ref (GstVpeBufferPool * pool, GstBuffer * in);
 
+GstVideoFormat gst_vpe_fourcc_to_video_format (guint32 fourcc);
+
+typedef enum
+{
+  GST_VPE_ALLOCATOR_OMAP_DRM,
+  GST_VPE_ALLOCATOR_DMA_HEAP,
+  GST_VPE_ALLOCATOR_UDMABUF,
+} GstVpeAllocatorType;
+
+#define GST_TYPE_VPE_HEAP_ALLOCATOR    (gst_vpe_heap_allocator_get_type())
+
+typedef struct _GstVpeHeapAllocator GstVpeHeapAllocator;
+typedef struct _GstVpeHeapAllocatorClass GstVpeHeapAllocatorClass;
+
+GType gst_vpe_heap_allocator_get_type (void);
+
+GstAllocator *gst_vpe_heap_allocator_new (GstVpeAllocatorType type);
+
+struct omap_device *gst_vpe_device_get (void);
+
+void gst_vpe_device_put (struct omap_device *dev);
+
+void gst_vpe_device_set_grace_period (guint ms);
+
+guint gst_vpe_device_get_grace_period (void);
+
+void gst_vpe_reap (const gchar * key, GDestroyNotify func, gpointer data);
+
+void gst_vpe_reaper_join (const gchar * key);
+
+gchar *gst_vpe_node_acquire (const gchar * pool, gpointer user);
+
+void gst_vpe_node_release (const gchar * path, gpointer user);
+
+void gst_vpe_node_update (const gchar * path, gpointer user, gint in_flight,
+    GstClockTime frame_time);
+
+void gst_vpe_node_set_schedule (const gchar * path, gpointer user,
+    guint priority, GstClockTime interval);
+
+gboolean gst_vpe_node_may_queue (const gchar * path, gpointer user,
+    gint in_flight);
+
+void gst_vpe_node_queued (const gchar * path, gpointer user);
+
+void gst_vpe_node_idle (const gchar * path, gpointer user);
+
+gboolean gst_vpe_memory_reserve (gsize size, gboolean force);
+
+void gst_vpe_memory_release (gsize size);
+
+gboolean gst_vpe_memory_pin (gsize size, gboolean force);
+
+void gst_vpe_memory_unpin (gsize size);
+
+void gst_vpe_memory_set_budget (guint64 budget);
+
+guint64 gst_vpe_memory_get_budget (void);
+
+guint64 gst_vpe_memory_get_usage (guint * pinned_buffers);
+
+typedef struct _GstVpeFence GstVpeFence;
+
+GstVpeFence *gst_vpe_fence_new (void);
+
+GstVpeFence *gst_vpe_fence_ref (GstVpeFence * fence);
+
+void gst_vpe_fence_unref (GstVpeFence * fence);
+
+void gst_vpe_fence_signal (GstVpeFence * fence);
+
+gboolean gst_vpe_fence_is_signalled (GstVpeFence * fence);
+
+gboolean gst_vpe_fence_wait (GstVpeFence * fence, gint timeout);
+
+gint gst_vpe_fence_get_fd (GstVpeFence * fence);
+
+typedef struct
+{
+  GstMeta meta;
+  GstVpeFence *fence;
+  gint fd;                      /* Of the fence, for consumers that only poll */
+} GstVpeFenceMeta;
+
+GType gst_vpe_fence_meta_api_get_type (void);
+#define GST_VPE_FENCE_META_API_TYPE (gst_vpe_fence_meta_api_get_type ())
+
+const GstMetaInfo *gst_vpe_fence_meta_get_info (void);
+
+#define gst_buffer_get_vpe_fence_meta(b) \
+  ((GstVpeFenceMeta *) gst_buffer_get_meta ((b), GST_VPE_FENCE_META_API_TYPE))
+
+GstVpeFenceMeta *gst_buffer_add_vpe_fence_meta (GstBuffer * buf,
+    GstVpeFence * fence);
+
+typedef struct _GstVpeUpload GstVpeUpload;
+
+GstVpeUpload *gst_vpe_upload_new (void);
+
+void gst_vpe_upload_free (GstVpeUpload * upload);
+
+gboolean gst_vpe_upload_frame (GstVpeUpload * upload, GstBuffer * dst,
+    GstBuffer * src, guint32 fourcc, gint width, gint height);
+
 GstVpeBufferPool *gst_vpe_buffer_pool_new (gboolean output_port,
     guint max_buffer_count, guint min_buffer_count, guint32 v4l2_type,
     GstCaps * caps, GstVpeBufferAllocFunction buffer_alloc_function,
@@ -153,37 +332,111 @@ gboolean gst_vpe_buffer_pool_put (GstVpeBufferPool * pool, GstBuffer * buf);
 
 GstBuffer* gst_vpe_buffer_pool_import (GstVpeBufferPool * pool, GstBuffer * buf);
 
+gboolean gst_vpe_buffer_pool_reserve (GstVpeBufferPool * pool, GstBuffer * buf,
+    gboolean force);
+
+void gst_vpe_buffer_pool_unreserve (GstVpeBufferPool * pool, GstBuffer * buf);
+
 gboolean gst_vpe_buffer_pool_queue (GstVpeBufferPool * pool, GstBuffer * buf,
     gint * q_cnt);
 
 GstBuffer *gst_vpe_buffer_pool_dequeue (GstVpeBufferPool * pool);
 
+guint gst_vpe_buffer_pool_dequeue_all (GstVpeBufferPool * pool, GQueue * bufs);
+
+guint gst_vpe_buffer_pool_queue_all (GstVpeBufferPool * pool, GQueue * bufs);
+
 void gst_vpe_buffer_pool_destroy (GstVpeBufferPool * pool);
 
+gboolean gst_vpe_buffer_pool_request_buffers (GstVpeBufferPool * pool,
+    int video_fd, int count);
+
 gboolean gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool,
     int video_fd, gboolean streaming, gboolean interlaced);
 
+GstBuffer *gst_vpe_buffer_pool_peek_queued (GstVpeBufferPool * pool, guint n);
+
+void gst_vpe_buffer_pool_release_driver (GstVpeBufferPool * pool);
+
 struct _GstVpe
 {
   GstElement parent;
 
   GstPad *sinkpad, *srcpad;
 
+  /* Protects the streaming state: device, pools, queues and counters. It
+   * is held across the ioctls, so that the object lock, which is taken by
+   * the core and by the property accessors, never waits on the driver.
+   * Taken before the object lock. */
+  GMutex state_lock;
+  GCond dequeue_cond;           /* Frames came back, or streaming stopped */
+  gboolean pushing;             /* A thread dequeues and pushes output */
+  GCond push_cond;
+  GstFlowReturn output_flow;    /* Last failed push of the dequeue loop */
+
   GstCaps *input_caps, *output_caps;
 
   GstVpeBufferPool *input_pool, *output_pool;
+  GstBufferPool *downstream_pool;       /* dmabuf pool offered by downstream */
   gint num_input_buffers, num_output_buffers;
   gint input_height, input_width;
   gint input_max_ref_frames;
   guint32 input_fourcc;
+  gint input_num_planes;        /* 2 for NV12 with a separate chroma plane */
+  gint input_stride[2];         /* From GstVideoMeta, 0 if unknown */
   gint output_height, output_width;
   guint32 output_fourcc;
   struct v4l2_crop input_crop;
   struct v4l2_format input_format;
   struct v4l2_format output_format;
+  struct v4l2_rect output_compose;      /* Area of the output frame the VPE scales into */
+  gint input_par_n, input_par_d;
+  gint output_par_n, output_par_d;
+  gboolean add_borders;
+  GstVpeMemoryMode memory_mode;
+  GstVpeAllocatorType allocator_type;
+  GstAllocator *allocator;      /* dma-heap or udmabuf allocator */
   gboolean interlaced;
+  gboolean deinterlace;         /* The driver gets both fields of the input */
   gboolean fixed_caps;
   gboolean passthrough;
+  gboolean over_budget;         /* Input is held back by the memory budget */
+  gboolean prewarm;
+  gboolean async_teardown;      /* Pools and device go away in the reaper */
+  gboolean prewarm_pending;     /* Caps are known, the dequeue loop prewarms */
+  GstVpeDropPolicy drop_policy;
+  guint keep_every;             /* Frames kept by keep-every-nth */
+  guint overload_frames;        /* Frames received while overloaded */
+  gboolean trickmode;           /* The segment is a trick mode one */
+  guint trickmode_scale;
+  gboolean reverse_reorder;
+  gboolean reverse;             /* Output frames are held for reordering */
+  GQueue reverse_q;             /* Copies of the frames of the current chunk */
+  GstVpeLatencyMode latency_mode;
+  gint input_queue_depth;       /* 0 is auto */
+  guint downstream_min;         /* Buffers downstream asked for */
+  gboolean downstream_fences;   /* Downstream waits for the fence meta */
+  GstClockTime output_hold_time;        /* hold_time of the previous output pool */
+  gint input_q_max;             /* Current limit of input_q_depth */
+  guint auto_frames, auto_waits, auto_idle;     /* Over the last window */
+  gint auto_peak;
+  guint64 frames_queued, frames_output;
+  GstClockTime qbuf_time[LATENCY_RING];
+  gboolean reconfiguring;       /* CAPTURE queue is being restarted */
+
+  /* What the driver was last set up for. It keeps the formats, selections
+   * and buffers over a stream off, so a restart with the same key only
+   * has to queue the buffers and stream on again. */
+  struct
+  {
+    gboolean valid;
+    GstCaps *input_caps, *output_caps;
+    gboolean trickmode;
+    gint input_num_planes;
+    gint input_stride[2];
+    struct v4l2_crop input_crop;
+  } config;
+  guint64 restarts, cached_restarts;
   GstSegment segment;
   enum
   { GST_VPE_ST_INIT, GST_VPE_ST_ACTIVE, GST_VPE_ST_STREAMING,
@@ -193,14 +446,51 @@ struct _GstVpe
   gint video_fd;
   struct omap_device *dev;
   gchar *device;
+  gchar *device_pool;           /* Comma separated devices to balance over */
+  gchar *node;                  /* Device of the pool in use */
+  gchar *reap_node;             /* Device our teardown jobs release */
+  GstClockTime last_output_time;        /* Start of the frame being processed */
+  guint priority;
+  gint target_framerate_n, target_framerate_d;
+  gint schedule_changed;        /* Atomic, the scheduler has to get the above */
   gint input_q_depth;
   gint output_q_processing;
   gint input_framerate_n, input_framerate_d;
   gint output_framerate_n, output_framerate_d;
   gint output_repeat_rate;
   GQueue input_q;
+  GstVpeUpload *upload;         /* Copies system memory input to dmabufs */
+  gint task_priority;           /* Real-time priority of the srcpad task, 0 for none */
+  GstVpeTaskPolicy task_policy;
+  guint cpu_affinity;           /* CPUs the srcpad task runs on, 0 for any */
+  gint task_sched_changed;      /* Atomic, the task has to apply the above */
+  GThread *task_thread;         /* Thread the task applied them to */
+  gboolean task_saved;          /* The settings task_thread came with: */
+  gint task_saved_policy;
+  struct sched_param task_saved_param;
+  cpu_set_t task_saved_cpus;
+  GThread *chain_thread;
+  clockid_t task_clock, chain_clock;
+  gboolean task_clock_valid, chain_clock_valid;
+  GstVpeFenceMode fence_mode;
+  GQueue early_q;               /* Output buffers handed out ahead, to push */
+  gint early_in_flight;         /* Frames in the driver pushed ahead */
+
+  /* Statistics, reported by the stats property. They are written with the
+   * object lock, the getter does not take the state lock. */
+  guint output_buffers;         /* buffer_count of the output pool */
+  guint64 upload_frames;
+  GstClockTime upload_time, upload_time_total;
+  guint64 dropped[GST_VPE_DROP_POLICY_LAST];    /* Frames dropped per policy */
+  guint64 latency_frames;
+  GstClockTime latency, latency_total, latency_max;     /* QBUF to push */
+  GstClockTime task_cpu_time, chain_cpu_time;   /* Last read */
+  guint64 early_frames;         /* Output frames pushed ahead of the driver */
 };
 
+#define GST_VPE_STATE_LOCK(vpe)     g_mutex_lock (&((vpe)->state_lock))
+#define GST_VPE_STATE_UNLOCK(vpe)   g_mutex_unlock (&((vpe)->state_lock))
+
 struct _GstVpeClass
 {
   GstElementClass parent_class;
@@ -0,0 +1,202 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Allocator of dmabufs that does not depend on omap_drm. Buffers come from
+ * the system dma-heap, or from memfds turned into dmabufs by udmabuf, and
+ * are handed out as GstDmaBufMemory.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstvpe.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_LINUX_DMA_HEAP_H
+#include <linux/dma-heap.h>
+#endif
+#if defined(HAVE_LINUX_UDMABUF_H) && defined(HAVE_MEMFD_CREATE)
+#include <linux/udmabuf.h>
+#define VPE_HAVE_UDMABUF 1
+#endif
+
+#define DMA_HEAP_DEVICE   "/dev/dma_heap/system"
+#define UDMABUF_DEVICE    "/dev/udmabuf"
+
+struct _GstVpeHeapAllocator
+{
+  GstAllocator parent;
+
+  GstVpeAllocatorType type;
+  gint dev_fd;                  /* dma-heap or udmabuf device */
+  GstAllocator *dmabuf;         /* Wraps the fds into memories */
+};
+
+struct _GstVpeHeapAllocatorClass
+{
+  GstAllocatorClass parent_class;
+};
+
+G_DEFINE_TYPE (GstVpeHeapAllocator, gst_vpe_heap_allocator,
+    GST_TYPE_ALLOCATOR);
+
+static int
+gst_vpe_heap_alloc_fd (GstVpeHeapAllocator * self, gsize size)
+{
+#ifdef HAVE_LINUX_DMA_HEAP_H
+  if (self->type == GST_VPE_ALLOCATOR_DMA_HEAP) {
+    struct dma_heap_allocation_data data = {
+      .len = size,
+      .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    if (ioctl (self->dev_fd, DMA_HEAP_IOCTL_ALLOC, &data) < 0) {
+      VPE_ERROR ("DMA_HEAP_IOCTL_ALLOC of %" G_GSIZE_FORMAT " failed: %s",
+          size, strerror (errno));
+      return -1;
+    }
+    return data.fd;
+  }
+#endif
+#ifdef VPE_HAVE_UDMABUF
+  if (self->type == GST_VPE_ALLOCATOR_UDMABUF) {
+    struct udmabuf_create create = {
+      .flags = UDMABUF_FLAGS_CLOEXEC,
+      .offset = 0,
+      .size = size,
+    };
+    int fd;
+
+    /* udmabuf wants a sealed memfd */
+    create.memfd = memfd_create ("gstvpe", MFD_ALLOW_SEALING);
+    if (create.memfd < 0)
+      return -1;
+    if (ftruncate (create.memfd, size) < 0 ||
+        fcntl (create.memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+      close (create.memfd);
+      return -1;
+    }
+    fd = ioctl (self->dev_fd, UDMABUF_CREATE, &create);
+    if (fd < 0)
+      VPE_ERROR ("UDMABUF_CREATE of %" G_GSIZE_FORMAT " failed: %s",
+          size, strerror (errno));
+    /* The dmabuf keeps the pages */
+    close (create.memfd);
+    return fd;
+  }
+#endif
+  return -1;
+}
+
+static GstMemory *
+gst_vpe_heap_allocator_alloc (GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+  GstVpeHeapAllocator *self = (GstVpeHeapAllocator *) allocator;
+  gsize page = sysconf (_SC_PAGESIZE);
+  gsize alloc_size;
+  int fd;
+
+  /* Both backends allocate whole pages */
+  alloc_size = (size + params->prefix + params->padding + page - 1) &
+      ~(page - 1);
+  fd = gst_vpe_heap_alloc_fd (self, alloc_size);
+  if (fd < 0)
+    return NULL;
+  return gst_dmabuf_allocator_alloc (self->dmabuf, fd, alloc_size);
+}
+
+static void
+gst_vpe_heap_allocator_free (GstAllocator * allocator, GstMemory * mem)
+{
+  /* The memories belong to the dmabuf allocator */
+  gst_allocator_free (mem->allocator, mem);
+}
+
+static void
+gst_vpe_heap_allocator_finalize (GObject * obj)
+{
+  GstVpeHeapAllocator *self = (GstVpeHeapAllocator *) obj;
+
+  if (self->dev_fd >= 0)
+    close (self->dev_fd);
+  if (self->dmabuf)
+    gst_object_unref (self->dmabuf);
+
+  G_OBJECT_CLASS (gst_vpe_heap_allocator_parent_class)->finalize (obj);
+}
+
+static void
+gst_vpe_heap_allocator_init (GstVpeHeapAllocator * self)
+{
+  GST_OBJECT_FLAG_SET (self, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+  self->dev_fd = -1;
+}
+
+static void
+gst_vpe_heap_allocator_class_init (GstVpeHeapAllocatorClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  allocator_class->alloc = gst_vpe_heap_allocator_alloc;
+  allocator_class->free = gst_vpe_heap_allocator_free;
+  gobject_class->finalize = gst_vpe_heap_allocator_finalize;
+}
+
+/* Returns NULL if the backend is not available on this system */
+GstAllocator *
+gst_vpe_heap_allocator_new (GstVpeAllocatorType type)
+{
+  GstVpeHeapAllocator *self;
+  const gchar *device;
+
+  switch (type) {
+#ifdef HAVE_LINUX_DMA_HEAP_H
+    case GST_VPE_ALLOCATOR_DMA_HEAP:
+      device = DMA_HEAP_DEVICE;
+      break;
+#endif
+#ifdef VPE_HAVE_UDMABUF
+    case GST_VPE_ALLOCATOR_UDMABUF:
+      device = UDMABUF_DEVICE;
+      break;
+#endif
+    default:
+      VPE_ERROR ("Allocator %d is not supported by this build", type);
+      return NULL;
+  }
+
+  self = g_object_new (GST_TYPE_VPE_HEAP_ALLOCATOR, NULL);
+  self->type = type;
+  self->dev_fd = open (device, O_RDWR | O_CLOEXEC);
+  if (self->dev_fd < 0) {
+    VPE_ERROR ("Cannot open %s: %s", device, strerror (errno));
+    gst_object_unref (self);
+    return NULL;
+  }
+  self->dmabuf = gst_dmabuf_allocator_new ();
+  VPE_DEBUG ("Allocating dmabufs from %s", device);
+  return GST_ALLOCATOR (self);
+}
@@ -23,6 +23,13 @@
 #endif
 
 #include "gstvpebins.h"
+#include "gstvpe.h"
+
+enum
+{
+  PROP_BIN_0,
+  PROP_BIN_LATENCY_MODE
+};
 
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
@@ -101,6 +108,7 @@ static GstStaticPadTemplate ducatijpegdec_sink_factory = GST_STATIC_PAD_TEMPLATE
   \
 typedef struct {               \
   GstBin parent;               \
+  GstElement *vpe;             \
 } type;                        \
 typedef struct {               \
   GstBinClass parent_class;    \
@@ -110,10 +118,38 @@ static void gst_vpe_ ## decoder_name ## _class_init   (gpointer      g_class); \
 static void gst_vpe_ ## decoder_name ## _init         (type          *self,    \
        type ## Class *klass);\
 static GstBinClass *decoder_name ## _parent_class = NULL;        \
+static void                                                                  \
+gst_vpe_ ## decoder_name ## _set_property (GObject * obj, guint prop_id,     \
+    const GValue * value, GParamSpec * pspec)                                \
+{                                                                            \
+  type *self = (type *) obj;                                                 \
+  if (prop_id == PROP_BIN_LATENCY_MODE && self->vpe)                         \
+    g_object_set_property (G_OBJECT (self->vpe), "latency-mode", value);     \
+  else                                                                       \
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);                 \
+}                                                                            \
+static void                                                                  \
+gst_vpe_ ## decoder_name ## _get_property (GObject * obj, guint prop_id,     \
+    GValue * value, GParamSpec * pspec)                                      \
+{                                                                            \
+  type *self = (type *) obj;                                                 \
+  if (prop_id == PROP_BIN_LATENCY_MODE && self->vpe)                         \
+    g_object_get_property (G_OBJECT (self->vpe), "latency-mode", value);     \
+  else if (prop_id != PROP_BIN_LATENCY_MODE)                                 \
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);                 \
+}                                                                            \
 static void                                                      \
 gst_vpe_ ## decoder_name ## _class_init (gpointer g_class)       \
 {                                                                            \
+  GObjectClass *gobject_class = G_OBJECT_CLASS (g_class);                    \
   GstElementClass *element_class = GST_ELEMENT_CLASS (g_class);              \
+  gobject_class->set_property = gst_vpe_ ## decoder_name ## _set_property;   \
+  gobject_class->get_property = gst_vpe_ ## decoder_name ## _get_property;   \
+  g_object_class_install_property (gobject_class, PROP_BIN_LATENCY_MODE,     \
+      g_param_spec_enum ("latency-mode", "Latency mode",                     \
+          "Latency mode of the vpe element", GST_TYPE_VPE_LATENCY_MODE,      \
+          GST_VPE_LATENCY_NORMAL,                                            \
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));                      \
   gst_element_class_set_static_metadata (element_class,                      \
       #decoder_name "vpe",                                                   \
       "Codec/Decoder/Video",                                                 \
@@ -142,9 +178,9 @@ static void gst_vpe_##decoder_name##_init (type *self, type ## Class *Klass) \
     return;                                                                  \
   }                                                                          \
   gst_bin_add_many(GST_BIN(self), dec, vpe, NULL);                           \
+  self->vpe = vpe;                                                           \
   gst_element_link_many(dec, vpe, NULL);                                     \
   g_object_set(G_OBJECT (vpe), "num-input-buffers", 0, NULL);                \
-  g_object_set(G_OBJECT (vpe), "num-output-buffers", 8, NULL);               \
   g_object_set(G_OBJECT (dec), "max-reorder-frames", 0, NULL);               \
   tmp = gst_element_get_static_pad(dec, "sink");                             \
   if (tmp) {                                                                 \
@@ -24,32 +24,49 @@
 #include "gstvpe.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+/* Buffers are known to a pool by the dmabuf fd of their first memory, or
+ * by its address for USERPTR pools
+ */
+static gboolean
+gst_vpe_buffer_key (GstVpeBufferPool * pool, GstBuffer * buf, gpointer * key)
+{
+  GstMemory *mem = gst_buffer_peek_memory (buf, 0);
+  GstMapInfo info;
+
+  if (mem == NULL)
+    return FALSE;
+  if (pool->memory == V4L2_MEMORY_USERPTR) {
+    if (gst_is_fd_memory (mem) || !gst_memory_map (mem, &info, GST_MAP_READ))
+      return FALSE;
+    *key = info.data;
+    gst_memory_unmap (mem, &info);
+    return TRUE;
+  }
+  /* System memory buffers have no fd, and are never known to the pool */
+  if (!gst_is_fd_memory (mem))
+    return FALSE;
+  *key = GINT_TO_POINTER (gst_fd_memory_get_fd (mem));
+  return TRUE;
+}
 
 GstVPEBufferPriv *
 gst_buffer_get_vpe_buffer_priv (GstVpeBufferPool * pool, GstBuffer * buf)
 {
-  int fd_copy;
-  GstMemory *mem;
+  gpointer key;
   GstVPEBufferPriv *vpemeta;
 
   printf
       ("gstvpebuffer.c: gst_buffer_get_vpe_buffer_priv: GstVpeBufferPool->vpebufferpriv: %p, GstBuffer: %p\n",
       pool->vpebufferpriv, buf);
-  mem = gst_buffer_peek_memory (buf, 0);
-  if (mem == NULL) {
-    printf
-        ("gstvpebuffer.c:gst_buffer_get_vpe_buffer_priv:  failed to peek into gstbuffer\n");
-  }
+  if (!gst_vpe_buffer_key (pool, buf, &key))
+    return NULL;
 
-  fd_copy = gst_fd_memory_get_fd (mem);
-  printf ("gstvpebuffer.c:gst_buffer_get_vpe_buffer_priv:  fd_copy: %d\n",
-      fd_copy);
-  if (fd_copy == 0) {
-    printf
-        ("gstvpebuffer.c:gst_buffer_get_vpe_buffer_priv:  did not receive fd_copy\n");
-  }
   //THIS IS WHERE THE CODE FAILS???
-  vpemeta = g_hash_table_lookup (pool->vpebufferpriv, (gpointer) fd_copy);
+  vpemeta = g_hash_table_lookup (pool->vpebufferpriv, key);
   if (vpemeta == NULL) {
     printf
         ("gstvpebuffer.c:gst_buffer_get_vpe_buffer_priv:  did not receive vpemeta\n");
@@ -57,6 +74,101 @@ gst_buffer_get_vpe_buffer_priv (GstVpeBufferPool * pool, GstBuffer * buf)
   return vpemeta;
 }
 
+GstVideoFormat
+gst_vpe_fourcc_to_video_format (guint32 fourcc)
+{
+  switch (fourcc) {
+    case GST_MAKE_FOURCC ('Y', 'U', 'Y', '2'):
+    case GST_MAKE_FOURCC ('Y', 'U', 'Y', 'V'):
+      return GST_VIDEO_FORMAT_YUY2;
+    case GST_MAKE_FOURCC ('N', 'V', '1', '2'):
+      return GST_VIDEO_FORMAT_NV12;
+    case GST_VIDEO_FORMAT_RGB:
+      return GST_VIDEO_FORMAT_RGB;
+  }
+  return GST_VIDEO_FORMAT_UNKNOWN;
+}
+
+/* Number of V4L2 planes needed to describe buf. NV12 whose chroma does not
+ * directly follow the luma, either because it lives in another memory
+ * (another dmabuf) or because GstVideoMeta says so, needs the two plane
+ * variant of the format (NV12M).
+ */
+gint
+gst_vpe_buffer_num_planes (guint32 fourcc, gint height, GstBuffer * buf)
+{
+  GstVideoMeta *meta;
+
+  if (fourcc != GST_MAKE_FOURCC ('N', 'V', '1', '2'))
+    return 1;
+  if (gst_buffer_n_memory (buf) > 1)
+    return 2;
+  meta = gst_buffer_get_video_meta (buf);
+  if (meta && meta->n_planes == 2 &&
+      meta->offset[1] != meta->offset[0] + meta->stride[0] * height)
+    return 2;
+  return 1;
+}
+
+/* The layout the driver uses for the memories of buf: planes, their
+ * offsets from the start of the buffer and their strides. Returns the
+ * number of planes, 0 for a format without a video format.
+ */
+static guint
+gst_vpe_buffer_driver_layout (GstVpeBufferPool * pool, GstBuffer * buf,
+    guint32 fourcc, gint width, gint height,
+    gsize offset[GST_VIDEO_MAX_PLANES], gint stride[GST_VIDEO_MAX_PLANES])
+{
+  GstVideoFormat format = gst_vpe_fourcc_to_video_format (fourcc);
+  guint n_planes = 1;
+  GstVideoInfo info;
+
+  memset (offset, 0, GST_VIDEO_MAX_PLANES * sizeof (gsize));
+  memset (stride, 0, GST_VIDEO_MAX_PLANES * sizeof (gint));
+  if (format == GST_VIDEO_FORMAT_UNKNOWN)
+    return 0;
+
+  gst_video_info_set_format (&info, format, width, height);
+  stride[0] = GST_VIDEO_INFO_PLANE_STRIDE (&info, 0);
+  if (pool->format && pool->format->fmt.pix_mp.plane_fmt[0].bytesperline)
+    stride[0] = pool->format->fmt.pix_mp.plane_fmt[0].bytesperline;
+
+  if (format == GST_VIDEO_FORMAT_NV12) {
+    n_planes = 2;
+    stride[1] = stride[0];
+    offset[1] = stride[0] * height;
+    if (gst_buffer_n_memory (buf) > 1) {
+      /* Chroma is in the second memory */
+      offset[1] = gst_memory_get_sizes (gst_buffer_peek_memory (buf, 0),
+          NULL, NULL);
+      if (pool->format->fmt.pix_mp.plane_fmt[1].bytesperline)
+        stride[1] = pool->format->fmt.pix_mp.plane_fmt[1].bytesperline;
+    }
+  }
+  return n_planes;
+}
+
+/* Attach a GstVideoMeta describing the layout the driver uses */
+static void
+gst_vpe_buffer_add_video_meta (GstVpeBufferPool * pool, GstBuffer * buf,
+    guint32 fourcc, gint width, gint height)
+{
+  GstVideoFormat format = gst_vpe_fourcc_to_video_format (fourcc);
+  gsize offset[GST_VIDEO_MAX_PLANES];
+  gint stride[GST_VIDEO_MAX_PLANES];
+  guint n_planes;
+
+  n_planes = gst_vpe_buffer_driver_layout (pool, buf, fourcc, width, height,
+      offset, stride);
+  if (!n_planes)
+    return;
+
+  if (!gst_buffer_add_video_meta_full (buf, GST_VIDEO_FRAME_FLAG_NONE,
+          format, width, height, n_planes, offset, stride)) {
+    VPE_DEBUG ("Failed to add video meta to buffer");
+  }
+}
+
 GstBuffer *
 gst_vpe_buffer_new (GstVpeBufferPool * pool, struct omap_device * dev,
     guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type)
@@ -64,33 +176,59 @@ gst_vpe_buffer_new (GstVpeBufferPool * pool, struct omap_device * dev,
   GstVPEBufferPriv *vpemeta;
   GstVideoCropMeta *crop;
   int size = 0;
+  gsize sizes[2] = { 0, 0 };
+  int i, n_sizes = 0;
   GstBuffer *buf;
-  GstAllocator *allocator = gst_drm_allocator_get ();
+  GstAllocator *allocator =
+      pool->allocator ? pool->allocator : gst_drm_allocator_get ();
+  GstAllocationParams params;
+
+  gst_allocation_params_init (&params);
+  if (pool->memory == V4L2_MEMORY_USERPTR) {
+    /* Page aligned system memory */
+    allocator = NULL;
+    params.align = sysconf (_SC_PAGESIZE) - 1;
+  }
 
-  buf = gst_buffer_new ();
-  if (!buf)
-    return NULL;
   //printf("gstvpebuffer.c:gst_vpe_buffer_new\n");
-  switch (fourcc) {
-    case GST_MAKE_FOURCC ('A', 'R', '2', '4'):
-      size = width * height * 4;
-      break;
-    case GST_MAKE_FOURCC ('Y', 'U', 'Y', '2'):
-    case GST_MAKE_FOURCC ('Y', 'U', 'Y', 'V'):
-      size = width * height * 2;
-      break;
-    case GST_MAKE_FOURCC ('N', 'V', '1', '2'):
-      printf ("gstvpebuffer.c:gst_vpe_buffer_new, entered through NV12\n");
-      size = (width * height * 3) / 2;
-      break;
-    case GST_VIDEO_FORMAT_RGB:
-      printf
-          ("gstvpebuffer.c:gst_vpe_buffer_new, entered through GST_VIDEO_FORMAT_RGB\n");
-      size = (width * height * 3);
-      break;
+  if (pool->format && pool->format->fmt.pix_mp.plane_fmt[0].sizeimage) {
+    /* The format is set, allocate what the driver asks for, with one
+     * memory per plane */
+    for (i = 0; i < pool->format->fmt.pix_mp.num_planes && i < 2; i++) {
+      sizes[i] = pool->format->fmt.pix_mp.plane_fmt[i].sizeimage;
+      n_sizes++;
+    }
+  } else {
+    switch (fourcc) {
+      case GST_MAKE_FOURCC ('A', 'R', '2', '4'):
+        size = width * height * 4;
+        break;
+      case GST_MAKE_FOURCC ('Y', 'U', 'Y', '2'):
+      case GST_MAKE_FOURCC ('Y', 'U', 'Y', 'V'):
+        size = width * height * 2;
+        break;
+      case GST_MAKE_FOURCC ('N', 'V', '1', '2'):
+        printf ("gstvpebuffer.c:gst_vpe_buffer_new, entered through NV12\n");
+        size = (width * height * 3) / 2;
+        break;
+      case GST_VIDEO_FORMAT_RGB:
+        printf
+            ("gstvpebuffer.c:gst_vpe_buffer_new, entered through GST_VIDEO_FORMAT_RGB\n");
+        size = (width * height * 3);
+        break;
+    }
+    sizes[n_sizes++] = size;
   }
 
-  gst_buffer_append_memory (buf, gst_allocator_alloc (allocator, size, NULL));
+  if (!gst_vpe_memory_reserve (sizes[0] + sizes[1], pool->overcommit)) {
+    VPE_DEBUG ("Memory budget exhausted, not allocating buffer %d", index);
+    return NULL;
+  }
+
+  buf = gst_buffer_new ();
+  for (i = 0; i < n_sizes; i++)
+    gst_buffer_append_memory (buf, gst_allocator_alloc (allocator, sizes[i],
+            &params));
 
   vpemeta = gst_vpe_buffer_priv (pool, dev,
       fourcc, width, height, index, v4l2_type, buf);
@@ -98,9 +236,11 @@ gst_vpe_buffer_new (GstVpeBufferPool * pool, struct omap_device * dev,
   if (!vpemeta) {
     printf ("gstvpebuffer.c:gst_vpe_buffer_new: failed to add vpe metadata\n");
     VPE_ERROR ("Failed to add vpe metadata");
+    gst_vpe_memory_release (sizes[0] + sizes[1]);
     gst_buffer_unref (buf);
     return NULL;
   }
+  vpemeta->accounted = sizes[0] + sizes[1];
 
 
   /* attach dmabuf handle to buffer so that elements from other
@@ -117,18 +257,207 @@ gst_vpe_buffer_new (GstVpeBufferPool * pool, struct omap_device * dev,
     crop->width = width;
   }
 
+  gst_vpe_buffer_add_video_meta (pool, buf, fourcc, width, height);
+
   VPE_DEBUG ("Allocated a new VPE buffer, %dx%d, index: %d, type: %d",
       width, height, index, v4l2_type);
 
   return buf;
 }
 
+/* Export a driver allocated (V4L2_MEMORY_MMAP) buffer as dmabufs, one
+ * memory per plane. The buffers must have been requested on the pool.
+ */
+GstBuffer *
+gst_vpe_buffer_export (GstVpeBufferPool * pool, struct omap_device * dev,
+    guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type)
+{
+  static GstAllocator *dmabuf_allocator = NULL;
+  GstVPEBufferPriv *vpemeta;
+  struct v4l2_exportbuffer expbuf;
+  struct v4l2_buffer qbuf;
+  struct v4l2_plane planes[2];
+  GstVideoCropMeta *crop;
+  GstBuffer *buf;
+  guint i;
+
+  if (g_once_init_enter (&dmabuf_allocator))
+    g_once_init_leave (&dmabuf_allocator, gst_dmabuf_allocator_new ());
+
+  memset (&qbuf, 0, sizeof (qbuf));
+  memset (planes, 0, sizeof (planes));
+  qbuf.type = v4l2_type;
+  qbuf.memory = V4L2_MEMORY_MMAP;
+  qbuf.index = index;
+  qbuf.m.planes = planes;
+  qbuf.length = 2;
+  if (ioctl (pool->video_fd, VIDIOC_QUERYBUF, &qbuf) < 0) {
+    VPE_ERROR ("VIDIOC_QUERYBUF failed for index %d: %s", index,
+        strerror (errno));
+    return NULL;
+  }
+
+  buf = gst_buffer_new ();
+  for (i = 0; i < qbuf.length; i++) {
+    memset (&expbuf, 0, sizeof (expbuf));
+    expbuf.type = v4l2_type;
+    expbuf.index = index;
+    expbuf.plane = i;
+    expbuf.flags = O_CLOEXEC | O_RDWR;
+    if (ioctl (pool->video_fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+      VPE_ERROR ("VIDIOC_EXPBUF failed for index %d: %s", index,
+          strerror (errno));
+      gst_buffer_unref (buf);
+      return NULL;
+    }
+    gst_buffer_append_memory (buf, gst_dmabuf_allocator_alloc
+        (dmabuf_allocator, expbuf.fd, planes[i].length));
+  }
+
+  buf = gst_vpe_buffer_import (pool, dev, fourcc, width, height, index,
+      v4l2_type, buf);
+  if (!buf)
+    return NULL;
+
+  /* The driver allocated the memory already, it can only be accounted */
+  vpemeta = gst_buffer_get_vpe_buffer_priv (pool, buf);
+  vpemeta->accounted = gst_buffer_get_size (buf);
+  gst_vpe_memory_reserve (vpemeta->accounted, TRUE);
+
+  crop = gst_buffer_add_video_crop_meta (buf);
+  if (!crop) {
+    VPE_DEBUG ("Failed to add crop meta to buffer");
+  } else {
+    crop->x = 0;
+    crop->y = 0;
+    crop->height = height;
+    crop->width = width;
+  }
+
+  gst_vpe_buffer_add_video_meta (pool, buf, fourcc, width, height);
+
+  VPE_DEBUG ("Exported driver buffer, %dx%d, index: %d, type: %d",
+      width, height, index, v4l2_type);
+  return buf;
+}
+
+/* Wrap the memory of a buffer from a downstream pool so that the VPE
+ * renders straight into it. The downstream buffer is attached as parent
+ * and goes back to its pool when the wrapper is freed.
+ */
+GstBuffer *
+gst_vpe_buffer_wrap (GstVpeBufferPool * pool, struct omap_device * dev,
+    guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type,
+    GstBuffer * parent)
+{
+  GstVideoMeta *pmeta;
+  GstVideoCropMeta *crop;
+  GstVideoInfo info;
+  GstBuffer *buf;
+  gsize size = 0, mem_offset, offset[GST_VIDEO_MAX_PLANES];
+  gint stride[GST_VIDEO_MAX_PLANES];
+  guint i, n_planes;
+
+  for (i = 0; i < gst_buffer_n_memory (parent); i++) {
+    if (!gst_is_fd_memory (gst_buffer_peek_memory (parent, i))) {
+      VPE_DEBUG ("Downstream buffer is not dmabuf backed");
+      return NULL;
+    }
+  }
+  for (i = 0; i < pool->format->fmt.pix_mp.num_planes; i++)
+    size += pool->format->fmt.pix_mp.plane_fmt[i].sizeimage;
+  if (gst_buffer_get_size (parent) < size) {
+    VPE_DEBUG ("Downstream buffer too small: %" G_GSIZE_FORMAT " < %"
+        G_GSIZE_FORMAT, gst_buffer_get_size (parent), size);
+    return NULL;
+  }
+  /* The driver writes its own layout, and the planes are filled from the
+   * fds alone: downstream has to use the same one, from the start of its
+   * memories */
+  n_planes = gst_vpe_buffer_driver_layout (pool, parent, fourcc, width,
+      height, offset, stride);
+  pmeta = gst_buffer_get_video_meta (parent);
+  if (pmeta) {
+    if (pmeta->n_planes != n_planes) {
+      VPE_DEBUG ("Downstream buffer has %u planes, the driver %u",
+          pmeta->n_planes, n_planes);
+      return NULL;
+    }
+    for (i = 0; i < n_planes; i++) {
+      if (pmeta->offset[i] != offset[i] || pmeta->stride[i] != stride[i]) {
+        VPE_DEBUG ("Downstream plane %u at %" G_GSIZE_FORMAT " stride %d, "
+            "the driver's at %" G_GSIZE_FORMAT " stride %d", i,
+            pmeta->offset[i], pmeta->stride[i], offset[i], stride[i]);
+        return NULL;
+      }
+    }
+  } else if (n_planes) {
+    /* Without a meta, downstream expects the default layout */
+    gst_video_info_set_format (&info, gst_vpe_fourcc_to_video_format
+        (fourcc), width, height);
+    for (i = 0; i < n_planes; i++) {
+      if (GST_VIDEO_INFO_PLANE_OFFSET (&info, i) != offset[i] ||
+          GST_VIDEO_INFO_PLANE_STRIDE (&info, i) != stride[i]) {
+        VPE_DEBUG ("Downstream buffer has the default layout, not the "
+            "driver's");
+        return NULL;
+      }
+    }
+  }
+  for (i = 0; i < gst_buffer_n_memory (parent); i++) {
+    gst_memory_get_sizes (gst_buffer_peek_memory (parent, i), &mem_offset,
+        NULL);
+    if (mem_offset) {
+      VPE_DEBUG ("Downstream memory %u starts %" G_GSIZE_FORMAT " bytes into "
+          "its dmabuf", i, mem_offset);
+      return NULL;
+    }
+  }
+
+  /* The driver pins the buffer for as long as the pool holds it */
+  if (!gst_vpe_memory_reserve (size, pool->overcommit)) {
+    VPE_DEBUG ("Memory budget exhausted, not wrapping buffer %d", index);
+    return NULL;
+  }
+
+  buf = gst_buffer_new ();
+  for (i = 0; i < gst_buffer_n_memory (parent); i++)
+    gst_buffer_append_memory (buf, gst_buffer_get_memory (parent, i));
+  gst_buffer_add_parent_buffer_meta (buf, parent);
+
+  buf = gst_vpe_buffer_import (pool, dev, fourcc, width, height, index,
+      v4l2_type, buf);
+  if (!buf) {
+    gst_vpe_memory_release (size);
+    return NULL;
+  }
+  gst_buffer_get_vpe_buffer_priv (pool, buf)->accounted = size;
+
+  crop = gst_buffer_add_video_crop_meta (buf);
+  if (!crop) {
+    VPE_DEBUG ("Failed to add crop meta to buffer");
+  } else {
+    crop->x = 0;
+    crop->y = 0;
+    crop->height = height;
+    crop->width = width;
+  }
+
+  gst_vpe_buffer_add_video_meta (pool, buf, fourcc, width, height);
+
+  VPE_DEBUG ("Wrapped a downstream buffer, %dx%d, index: %d", width, height,
+      index);
+  return buf;
+}
+
 GstBuffer *
 gst_vpe_buffer_ref (GstVpeBufferPool * pool, GstBuffer * in)
 {
   GstVPEBufferPriv *vpemeta;
   GstVideoCropMeta *crop, *incrop;
+  GstVideoMeta *invmeta;
   int size;
+  guint i;
   GstBuffer *buf;
   GstAllocator *allocator = gst_drm_allocator_get ();
   int fd_copy;
@@ -148,7 +477,8 @@ gst_vpe_buffer_ref (GstVpeBufferPool * pool, GstBuffer * in)
     return NULL;
   }
 
-  gst_buffer_append_memory (buf, gst_buffer_get_memory (buf, 0));
+  for (i = 0; i < gst_buffer_n_memory (in); i++)
+    gst_buffer_append_memory (buf, gst_buffer_get_memory (in, i));
 
   /* attach dmabuf handle to buffer so that elements from other
    * plugins can access for zero copy hw accel:
@@ -167,6 +497,13 @@ gst_vpe_buffer_ref (GstVpeBufferPool * pool, GstBuffer * in)
     }
   }
 
+  invmeta = gst_buffer_get_video_meta (in);
+  if (invmeta) {
+    gst_buffer_add_video_meta_full (buf, invmeta->flags, invmeta->format,
+        invmeta->width, invmeta->height, invmeta->n_planes,
+        invmeta->offset, invmeta->stride);
+  }
+
   return buf;
 }
 
@@ -188,6 +525,56 @@ gst_vpe_buffer_import (GstVpeBufferPool * pool, struct omap_device * dev,
   return buf;
 }
 
+/* Fill in the V4L2 planes of vpebuf for buf. Once the format is set,
+ * the number of planes is the one of the format, and a contiguous buffer
+ * is described as two planes of the same dmabuf if needed.
+ */
+static gboolean
+gst_vpe_buffer_fill_planes (GstVpeBufferPool * pool,
+    GstVPEBufferPriv * vpebuf, guint32 fourcc, gint width, gint height,
+    GstBuffer * buf, int fd)
+{
+  GstVideoMeta *meta = gst_buffer_get_video_meta (buf);
+  gint num_planes = gst_vpe_buffer_num_planes (fourcc, height, buf);
+  gint stride;
+
+  if (pool->format && pool->format->fmt.pix_mp.num_planes) {
+    if (num_planes > pool->format->fmt.pix_mp.num_planes) {
+      VPE_ERROR ("Buffer layout needs %d planes, format has %d",
+          num_planes, pool->format->fmt.pix_mp.num_planes);
+      return FALSE;
+    }
+    num_planes = pool->format->fmt.pix_mp.num_planes;
+  }
+
+  vpebuf->v4l2_buf.length = num_planes;
+  vpebuf->v4l2_buf.m.planes[0].m.fd = fd;
+  if (meta && gst_buffer_n_memory (buf) == 1)
+    vpebuf->v4l2_buf.m.planes[0].data_offset = meta->offset[0];
+
+  if (num_planes == 2) {
+    if (gst_buffer_n_memory (buf) > 1) {
+      if (!gst_is_fd_memory (gst_buffer_peek_memory (buf, 1))) {
+        VPE_ERROR ("Chroma plane is not dmabuf backed");
+        return FALSE;
+      }
+      vpebuf->v4l2_buf.m.planes[1].m.fd =
+          gst_fd_memory_get_fd (gst_buffer_peek_memory (buf, 1));
+    } else {
+      vpebuf->v4l2_buf.m.planes[1].m.fd = fd;
+      if (meta) {
+        vpebuf->v4l2_buf.m.planes[1].data_offset = meta->offset[1];
+      } else {
+        stride = pool->format->fmt.pix_mp.plane_fmt[0].bytesperline;
+        if (!stride)
+          stride = width;
+        vpebuf->v4l2_buf.m.planes[1].data_offset = stride * height;
+      }
+    }
+  }
+  return TRUE;
+}
+
 GstVPEBufferPriv *
 gst_vpe_buffer_priv (GstVpeBufferPool * pool, struct omap_device * dev,
     guint32 fourcc, gint width, gint height, int index, guint32 v4l2_type,
@@ -196,14 +583,26 @@ gst_vpe_buffer_priv (GstVpeBufferPool * pool, struct omap_device * dev,
 
   GstVPEBufferPriv *vpebuf = g_malloc0 (sizeof (GstVPEBufferPriv));
 
-  int fd_copy;
-  GstMemory *mem;
+  int fd_copy = -1, i;
+  gpointer key;
 
   if (!vpebuf)
     goto fail;
 
-  mem = gst_buffer_peek_memory (buf, 0);
-  fd_copy = gst_fd_memory_get_fd (mem);
+  if (!gst_vpe_buffer_key (pool, buf, &key)) {
+    VPE_DEBUG ("Buffer %p cannot be used by a %s pool", buf,
+        pool->memory == V4L2_MEMORY_USERPTR ? "USERPTR" : "dmabuf");
+    goto fail;
+  }
+  if (pool->memory == V4L2_MEMORY_USERPTR) {
+    if (((guintptr) key & (sysconf (_SC_PAGESIZE) - 1)) ||
+        gst_buffer_n_memory (buf) > 1) {
+      VPE_DEBUG ("Buffer %p is not a page aligned single memory", buf);
+      goto fail;
+    }
+  } else {
+    fd_copy = GPOINTER_TO_INT (key);
+  }
 
 
   vpebuf->size = 0;
@@ -214,46 +613,44 @@ gst_vpe_buffer_priv (GstVpeBufferPool * pool, struct omap_device * dev,
   vpebuf->v4l2_buf.type = v4l2_type;
   vpebuf->v4l2_buf.index = index;
   vpebuf->v4l2_buf.m.planes = vpebuf->v4l2_planes;
-  vpebuf->v4l2_buf.memory = V4L2_MEMORY_DMABUF;
+  vpebuf->v4l2_buf.memory = pool->memory;
 
   switch (fourcc) {
     case GST_MAKE_FOURCC ('A', 'R', '2', '4'):
       vpebuf->size = width * height * 4;
-      vpebuf->bo = omap_bo_from_dmabuf (dev, fd_copy);
-      vpebuf->v4l2_buf.length = 1;
-      vpebuf->v4l2_buf.m.planes[0].m.fd = fd_copy;
       break;
     case GST_MAKE_FOURCC ('Y', 'U', 'Y', '2'):
     case GST_MAKE_FOURCC ('Y', 'U', 'Y', 'V'):
       vpebuf->size = width * height * 2;
-      vpebuf->bo = omap_bo_from_dmabuf (dev, fd_copy);
-      vpebuf->v4l2_buf.length = 1;
-      vpebuf->v4l2_buf.m.planes[0].m.fd = fd_copy;
       break;
     case GST_MAKE_FOURCC ('N', 'V', '1', '2'):
-      printf ("gstvpebuffer.c:gst_vpe_buffer_priv: entered case NV12\n");
       vpebuf->size = (width * height * 3) / 2;
-      vpebuf->bo = omap_bo_from_dmabuf (dev, fd_copy);
-      vpebuf->v4l2_buf.length = 1;
-      vpebuf->v4l2_buf.m.planes[0].m.fd = fd_copy;
       break;
     case GST_VIDEO_FORMAT_RGB:
-      printf
-          ("gstvpebuffer.c:gst_vpe_buffer_priv: entered case GST_VIDEO_FORMAT_RGB\n");
       vpebuf->size = (width * height * 3);
-      vpebuf->bo = omap_bo_from_dmabuf (dev, fd_copy);
-      vpebuf->v4l2_buf.length = 1;      //don't know if this is correct.  
-      //It's set to the number of elements in the planes array, which gets set by the driver to the proper size later
-      vpebuf->v4l2_buf.m.planes[0].m.fd = fd_copy;
       break;
     default:
       VPE_ERROR ("invalid format: 0x%08x", fourcc);
       goto fail;
   }
-  g_hash_table_insert (pool->vpebufferpriv, (gpointer) fd_copy, vpebuf);
+  /* v4l2_buf.length is the number of entries of the planes array */
+  if (!gst_vpe_buffer_fill_planes (pool, vpebuf, fourcc, width, height, buf,
+          fd_copy))
+    goto fail;
+  if (pool->memory == V4L2_MEMORY_USERPTR) {
+    /* The planes are given by address, offsets included */
+    for (i = 0; i < vpebuf->v4l2_buf.length; i++) {
+      vpebuf->v4l2_planes[i].m.userptr =
+          (unsigned long) key + vpebuf->v4l2_planes[i].data_offset;
+      vpebuf->v4l2_planes[i].data_offset = 0;
+    }
+  } else if (dev) {
+    vpebuf->bo = omap_bo_from_dmabuf (dev, fd_copy);
+  }
+  g_hash_table_insert (pool->vpebufferpriv, key, vpebuf);
   return vpebuf;
 fail:
-  gst_buffer_unref (buf);
+  g_free (vpebuf);
   return NULL;
 
 }
@@ -100,9 +100,21 @@ vpebufferpriv_free_func (GstVPEBufferPriv * priv)
     /* Free the DRM buffer */
     omap_bo_del (priv->bo);
   }
+  if (priv->accounted)
+    gst_vpe_memory_release (priv->accounted);
   g_free (priv);
 }
 
+/* Called with the pool lock, once the driver no longer holds buffer i */
+static void
+gst_vpe_buffer_pool_unpin (GstVpeBufferPool * pool, int i)
+{
+  if (pool->buf_tracking[i].pinned) {
+    gst_vpe_memory_unpin (pool->buf_tracking[i].pinned);
+    pool->buf_tracking[i].pinned = 0;
+  }
+}
+
 GstVpeBufferPool *
 gst_vpe_buffer_pool_new (gboolean output_port, guint max_buffer_count,
     guint min_buffer_count, guint32 v4l2_type, GstCaps * caps,
@@ -126,7 +138,11 @@ gst_vpe_buffer_pool_new (gboolean output_port, guint max_buffer_count,
   pool->shutting_down = FALSE;
   pool->streaming = FALSE;
   pool->v4l2_type = v4l2_type;
+  pool->memory = V4L2_MEMORY_DMABUF;
+  pool->reqbuf_count = 0;
   g_mutex_init (&pool->lock);
+  g_queue_init (&pool->ready);
+  g_queue_init (&pool->queued);
   pool->buffer_count = max_buffer_count;
   pool->min_buffer_count = min_buffer_count;
   pool->max_buffer_count = max_buffer_count;
@@ -202,6 +218,19 @@ gst_vpe_buffer_pool_put (GstVpeBufferPool * pool, GstBuffer * buffer)
     gst_buffer_unref (buffer);
     return TRUE;
   } else {
+    if (pool->buf_tracking[buf->v4l2_buf.index].out_time) {
+      GstClockTime hold = gst_util_get_timestamp () -
+          pool->buf_tracking[buf->v4l2_buf.index].out_time;
+      pool->hold_time = pool->hold_time ?
+          (pool->hold_time * 7 + hold) / 8 : hold;
+      pool->buf_tracking[buf->v4l2_buf.index].out_time = 0;
+    }
+    if (pool->output_port) {
+      /* Back from downstream, the fence of its last frame is of no use */
+      GstVpeFenceMeta *meta = gst_buffer_get_vpe_fence_meta (buffer);
+      if (meta && gst_buffer_is_writable (buffer))
+        gst_buffer_remove_meta (buffer, (GstMeta *) meta);
+    }
     if (pool->output_port && pool->streaming) {
       int r;
       /* QUEUE this buffer into the driver */
@@ -216,6 +245,7 @@ gst_vpe_buffer_pool_put (GstVpeBufferPool * pool, GstBuffer * buffer)
         pool->buf_tracking[buf->v4l2_buf.index].state = BUF_WITH_DRIVER;
         pool->buf_tracking[buf->v4l2_buf.index].buf = GST_BUFFER (buffer);
         pool->buf_tracking[buf->v4l2_buf.index].q_cnt = 1;
+        g_queue_push_tail (&pool->queued, buffer);
       }
     } else {
       VPE_DEBUG ("vpebufferpool: buf marked free: index = %d, q_cnt = %d",
@@ -243,6 +273,9 @@ static int
 gst_vpe_buffer_pool_pop_free_index (GstVpeBufferPool * pool, int buf_index)
 {
   int i;
+  /* Driver allocated buffers always use their own index */
+  if (pool->memory == V4L2_MEMORY_MMAP)
+    return buf_index;
   i = pool->free_head;
   if (0 <= i) {
     pool->free_head = pool->index_map[i];
@@ -255,103 +288,227 @@ static int
 gst_vpe_buffer_pool_push_free_index (GstVpeBufferPool * pool, int v4l2_index)
 {
   int i;
+  if (pool->memory == V4L2_MEMORY_MMAP)
+    return v4l2_index;
   i = pool->index_map[v4l2_index];
   pool->index_map[v4l2_index] = pool->free_head;
   pool->free_head = v4l2_index;
   return i;
 }
 
-/* Called to queue the buffer into the driver, if output_port flag is
- * not set
+/* DQBUF one buffer. Returns FALSE once the driver has nothing more to
+ * give back. *dqbuf is NULL if it returned a buffer that was not queued.
+ * Called with the pool lock.
  */
-GstBuffer *
-gst_vpe_buffer_pool_dequeue (GstVpeBufferPool * pool)
+static gboolean
+gst_vpe_buffer_pool_dequeue_one (GstVpeBufferPool * pool, GstBuffer ** dqbuf)
 {
   int ret, i;
   struct v4l2_buffer buf;
   struct v4l2_plane planes[2];
-  GstBuffer *dqbuf = NULL;
-
-  VPE_LOG ("Entered for %s Q", pool->output_port ? "output" : "input");
+  GstVPEBufferPriv *vpebuf;
+  GstVpeFenceMeta *meta;
 
-  GST_VPE_BUFFER_POOL_LOCK (pool);
+  *dqbuf = NULL;
   for (i = 0; i < pool->buffer_count; i++) {
     if (pool->buf_tracking[i].state == BUF_WITH_DRIVER) {
       break;
     }
   }
-  if (i < pool->buffer_count) {
-    GstVPEBufferPriv *vpebuf =
-        gst_buffer_get_vpe_buffer_priv (pool, pool->buf_tracking[i].buf);
-    memset (&planes, 0, sizeof planes);
-    buf = vpebuf->v4l2_buf;
-    buf.m.planes = planes;
-
-    // VPE_DEBUG("try de-queueing buffers from the driver");
-    ret = ioctl (pool->video_fd, VIDIOC_DQBUF, &buf);
-    if (ret < 0) {
-      if (errno == EAGAIN)
-        VPE_LOG ("No buffers to DQBUF from %s Q, try again",
-            pool->output_port ? "output" : "input");
-      else
-        VPE_ERROR ("vpebufferpool: DQBUF for %s failed: %s, index = %d",
-            pool->output_port ? "output" : "input",
-            strerror (errno), buf.index);
-      GST_VPE_BUFFER_POOL_UNLOCK (pool);
-      return NULL;
-    }
-    if (!pool->output_port) {
-      VPE_LOG ("DQBUF input for v4l2_index: %d", buf.index);
-      buf.index = gst_vpe_buffer_pool_push_free_index (pool, buf.index);
-    }
-    if (pool->buf_tracking[buf.index].state != BUF_WITH_DRIVER) {
-      VPE_WARNING ("Dequeued buffer that was not queued, index: %d", buf.index);
-      dqbuf = NULL;
-    } else {
-      dqbuf = pool->buf_tracking[buf.index].buf;
-      VPE_LOG
-          ("DQBUF for %s succeeded, index: %d, type: %d, field: %d, q_cnt: %d",
-          pool->output_port ? "output" : "input", buf.index, buf.type,
-          buf.field, pool->buf_tracking[buf.index].q_cnt);
+  if (i >= pool->buffer_count) {
+    VPE_LOG ("No buffers to dequeue from %s Q",
+        pool->output_port ? "output" : "input");
+    return FALSE;
+  }
+  vpebuf = gst_buffer_get_vpe_buffer_priv (pool, pool->buf_tracking[i].buf);
+  memset (&planes, 0, sizeof planes);
+  buf = vpebuf->v4l2_buf;
+  buf.m.planes = planes;
+
+  // VPE_DEBUG("try de-queueing buffers from the driver");
+  ret = ioctl (pool->video_fd, VIDIOC_DQBUF, &buf);
+  if (ret < 0) {
+    if (errno == EAGAIN)
+      VPE_LOG ("No buffers to DQBUF from %s Q, try again",
+          pool->output_port ? "output" : "input");
+    else
+      VPE_ERROR ("vpebufferpool: DQBUF for %s failed: %s, index = %d",
+          pool->output_port ? "output" : "input",
+          strerror (errno), buf.index);
+    return FALSE;
+  }
+  if (!pool->output_port) {
+    VPE_LOG ("DQBUF input for v4l2_index: %d", buf.index);
+    buf.index = gst_vpe_buffer_pool_push_free_index (pool, buf.index);
+  }
+  if (pool->buf_tracking[buf.index].state != BUF_WITH_DRIVER) {
+    VPE_WARNING ("Dequeued buffer that was not queued, index: %d", buf.index);
+  } else {
+    *dqbuf = pool->buf_tracking[buf.index].buf;
+    if (pool->output_port) {
+      pool->buf_tracking[buf.index].out_time = gst_util_get_timestamp ();
+      g_queue_remove (&pool->queued, *dqbuf);
     }
-    if (0 < pool->buf_tracking[buf.index].q_cnt)
-      pool->buf_tracking[buf.index].q_cnt--;
-    if (0 == pool->buf_tracking[buf.index].q_cnt)
-      pool->buf_tracking[buf.index].state = BUF_ALLOCATED;
-    GST_VPE_BUFFER_POOL_UNLOCK (pool);
+    VPE_LOG
+        ("DQBUF for %s succeeded, index: %d, type: %d, field: %d, q_cnt: %d",
+        pool->output_port ? "output" : "input", buf.index, buf.type,
+        buf.field, pool->buf_tracking[buf.index].q_cnt);
+  }
+  if (0 < pool->buf_tracking[buf.index].q_cnt)
+    pool->buf_tracking[buf.index].q_cnt--;
+  if (0 == pool->buf_tracking[buf.index].q_cnt) {
+    pool->buf_tracking[buf.index].state = BUF_ALLOCATED;
+    gst_vpe_buffer_pool_unpin (pool, buf.index);
+  }
 
-    if (dqbuf) {
-      if (buf.timestamp.tv_sec == (time_t) - 1) {
-        GST_BUFFER_PTS (dqbuf) = GST_CLOCK_TIME_NONE;
-      } else {
-        /* Assign a timestamp, propogated by the driver */
-        GST_BUFFER_PTS (dqbuf) = GST_TIMEVAL_TO_TIME (buf.timestamp);
-      }
+  /* A buffer pushed ahead is downstream already, its timestamps were set
+   * then */
+  if (*dqbuf && (meta = gst_buffer_get_vpe_fence_meta (*dqbuf)) &&
+      !gst_vpe_fence_is_signalled (meta->fence)) {
+    VPE_LOG ("DQBUF of a buffer pushed ahead, index: %d", buf.index);
+  } else if (*dqbuf) {
+    if (buf.timestamp.tv_sec == (time_t) - 1) {
+      GST_BUFFER_PTS (*dqbuf) = GST_CLOCK_TIME_NONE;
+    } else {
+      /* Assign a timestamp, propogated by the driver */
+      GST_BUFFER_PTS (*dqbuf) = GST_TIMEVAL_TO_TIME (buf.timestamp);
     }
-  } else {
-    VPE_LOG ("No buffers to dequeue from %s Q",
-        pool->output_port ? "output" : "input");
-    GST_VPE_BUFFER_POOL_UNLOCK (pool);
   }
+  return TRUE;
+}
+
+/* Take a buffer back from the driver. Output buffers already dequeued by
+ * gst_vpe_buffer_pool_dequeue_all() go first.
+ */
+GstBuffer *
+gst_vpe_buffer_pool_dequeue (GstVpeBufferPool * pool)
+{
+  GstBuffer *dqbuf = NULL;
+
+  VPE_LOG ("Entered for %s Q", pool->output_port ? "output" : "input");
+
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  if (pool->output_port)
+    dqbuf = (GstBuffer *) g_queue_pop_head (&pool->ready);
+  if (!dqbuf)
+    (void) gst_vpe_buffer_pool_dequeue_one (pool, &dqbuf);
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
   return dqbuf;
 }
 
-/* Called to queue the buffer into the driver, if output_port flag is
- * not set
+/* Dequeue every buffer the driver is done with, under a single lock, until
+ * it has no more. Input buffers are appended to bufs. Output buffers stay
+ * in the pool, to be handed out by gst_buffer_pool_acquire_buffer(), and
+ * bufs may be NULL. Returns the number of buffers dequeued, for an output
+ * pool the number ready to be acquired.
+ */
+guint
+gst_vpe_buffer_pool_dequeue_all (GstVpeBufferPool * pool, GQueue * bufs)
+{
+  GstBuffer *dqbuf;
+  guint n = 0;
+
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  while (gst_vpe_buffer_pool_dequeue_one (pool, &dqbuf)) {
+    if (!dqbuf)
+      continue;
+    g_queue_push_tail (pool->output_port ? &pool->ready : bufs, dqbuf);
+    n++;
+  }
+  if (pool->output_port)
+    n = g_queue_get_length (&pool->ready);
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+  return n;
+}
+
+/* The output buffer the driver fills n frames from now, NULL if it does
+ * not hold that many. The buffer stays owned by the pool.
+ */
+GstBuffer *
+gst_vpe_buffer_pool_peek_queued (GstVpeBufferPool * pool, guint n)
+{
+  GstBuffer *buf;
+
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  buf = (GstBuffer *) g_queue_peek_nth (&pool->queued, n);
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+  return buf;
+}
+
+/* Output buffers dequeued but not handed out are free again. Called with
+ * the pool lock.
+ */
+static void
+gst_vpe_buffer_pool_unstash (GstVpeBufferPool * pool)
+{
+  GstBuffer *buffer;
+  GstVPEBufferPriv *buf;
+
+  while (NULL != (buffer = (GstBuffer *) g_queue_pop_head (&pool->ready))) {
+    buf = gst_buffer_get_vpe_buffer_priv (pool, buffer);
+    pool->buf_tracking[buf->v4l2_buf.index].state = BUF_FREE;
+    pool->buf_tracking[buf->v4l2_buf.index].q_cnt = 1;
+    pool->buf_tracking[buf->v4l2_buf.index].out_time = 0;
+  }
+}
+
+/* Account buff against the memory budget before it is queued. Buffers
+ * we did not allocate are only counted while the driver holds them. If
+ * force is not set and the budget is exhausted, the buffer has to wait.
  */
 gboolean
-gst_vpe_buffer_pool_queue (GstVpeBufferPool * pool, GstBuffer * buff,
-    gint * q_cnt)
+gst_vpe_buffer_pool_reserve (GstVpeBufferPool * pool, GstBuffer * buff,
+    gboolean force)
+{
+  GstVPEBufferPriv *buf = gst_buffer_get_vpe_buffer_priv (pool, buff);
+  gboolean ret = TRUE;
+
+  if (!buf || buf->accounted)
+    return TRUE;
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  if (!pool->buf_tracking[buf->v4l2_buf.index].pinned) {
+    ret = gst_vpe_memory_pin (buf->size, force);
+    if (ret)
+      pool->buf_tracking[buf->v4l2_buf.index].pinned = buf->size;
+  }
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+  return ret;
+}
+
+/* Called with the pool lock */
+static void
+gst_vpe_buffer_pool_unreserve_locked (GstVpeBufferPool * pool,
+    GstBuffer * buff)
+{
+  GstVPEBufferPriv *buf = gst_buffer_get_vpe_buffer_priv (pool, buff);
+
+  if (buf && pool->buf_tracking[buf->v4l2_buf.index].state != BUF_WITH_DRIVER)
+    gst_vpe_buffer_pool_unpin (pool, buf->v4l2_buf.index);
+}
+
+/* Give back what gst_vpe_buffer_pool_reserve() took for buff, which is let
+ * go without being queued.
+ */
+void
+gst_vpe_buffer_pool_unreserve (GstVpeBufferPool * pool, GstBuffer * buff)
+{
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  gst_vpe_buffer_pool_unreserve_locked (pool, buff);
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+}
+
+/* QBUF one input buffer. Returns the number of times it is queued, 0 if
+ * the driver did not take it. Called with the pool lock.
+ */
+static gint
+gst_vpe_buffer_pool_queue_one (GstVpeBufferPool * pool, GstBuffer * buff)
 {
   int ret = 0;
   GstVPEBufferPriv *buf = gst_buffer_get_vpe_buffer_priv (pool, buff);
   struct v4l2_buffer buffer;
   struct v4l2_plane buf_planes[2];
-  struct v4l2_format *fmt;
-
+  gint q_cnt = 0;
 
-  *q_cnt = 0;
-  GST_VPE_BUFFER_POOL_LOCK (pool);
   if (pool->streaming) {
     VPE_DEBUG ("Queueing buffer, fd: %d", buf->v4l2_buf.m.planes[0].m.fd);
     if (GST_CLOCK_TIME_IS_VALID (GST_BUFFER_PTS (buff)))
@@ -360,10 +517,12 @@ gst_vpe_buffer_pool_queue (GstVpeBufferPool * pool, GstBuffer * buff,
       buf->v4l2_buf.timestamp.tv_sec = (time_t) - 1;
 
     buf->v4l2_planes[0].bytesused =
-        pool->format->fmt.pix_mp.plane_fmt[0].sizeimage;
+        pool->format->fmt.pix_mp.plane_fmt[0].sizeimage +
+        buf->v4l2_planes[0].data_offset;
     buf->v4l2_planes[0].length = buf->v4l2_planes[0].bytesused;
     buf->v4l2_planes[1].bytesused =
-        pool->format->fmt.pix_mp.plane_fmt[1].sizeimage;
+        pool->format->fmt.pix_mp.plane_fmt[1].sizeimage +
+        buf->v4l2_planes[1].data_offset;
     buf->v4l2_planes[1].length = buf->v4l2_planes[1].bytesused;
 
     buffer = buf->v4l2_buf;
@@ -385,21 +544,66 @@ gst_vpe_buffer_pool_queue (GstVpeBufferPool * pool, GstBuffer * buff,
       VPE_ERROR ("vpebufferpool: QBUF failed: %s, index = %d",
           strerror (errno), buffer.index);
     } else {
-      (*q_cnt)++;
+      q_cnt++;
     }
   }
-  if ((*q_cnt)) {
+  if (q_cnt) {
     pool->buf_tracking[buf->v4l2_buf.index].state = BUF_WITH_DRIVER;
   }
-  pool->buf_tracking[buf->v4l2_buf.index].q_cnt = (*q_cnt);
+  pool->buf_tracking[buf->v4l2_buf.index].q_cnt = q_cnt;
+  if (0 == q_cnt)
+    gst_vpe_buffer_pool_unpin (pool, buf->v4l2_buf.index);
   VPE_LOG ("Q_CNT after QBUF index = %d, q_cnt: %d",
-      buf->v4l2_buf.index, (*q_cnt));
+      buf->v4l2_buf.index, q_cnt);
+  return q_cnt;
+}
+
+/* Called to queue the buffer into the driver, if output_port flag is
+ * not set
+ */
+gboolean
+gst_vpe_buffer_pool_queue (GstVpeBufferPool * pool, GstBuffer * buff,
+    gint * q_cnt)
+{
+  gboolean streaming;
+
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  streaming = pool->streaming;
+  *q_cnt = gst_vpe_buffer_pool_queue_one (pool, buff);
   GST_VPE_BUFFER_POOL_UNLOCK (pool);
 
   if (0 == (*q_cnt))
     gst_buffer_unref (GST_BUFFER (buff));
 
-  return (ret == 0) ? TRUE : FALSE;
+  return (*q_cnt || !streaming) ? TRUE : FALSE;
+}
+
+/* Queue the input buffers of bufs from its head, under a single lock, until
+ * the driver refuses one, which is dropped. Returns the number of buffers
+ * queued, the ones after the refused one are left in bufs, with their
+ * reservation given back: they are checked against the budget again.
+ */
+guint
+gst_vpe_buffer_pool_queue_all (GstVpeBufferPool * pool, GQueue * bufs)
+{
+  GstBuffer *buff, *refused = NULL;
+  GList *l;
+  guint n = 0;
+
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  while (!refused && NULL != (buff = (GstBuffer *) g_queue_pop_head (bufs))) {
+    if (gst_vpe_buffer_pool_queue_one (pool, buff))
+      n++;
+    else
+      refused = buff;
+  }
+  for (l = bufs->head; l; l = l->next)
+    gst_vpe_buffer_pool_unreserve_locked (pool, (GstBuffer *) l->data);
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+
+  if (refused)
+    gst_buffer_unref (refused);
+  return n;
 }
 
 /* Called to get a free buffer from the pool
@@ -429,6 +633,9 @@ gst_vpe_buffer_pool_get (GstVpeBufferPool * pool)
       if (!pool->streaming || dbufs < 4) {
         VPE_WARNING ("Allocating a new input buffer index: %d/%d, %d",
             r, pool->buffer_count, dbufs);
+        /* Over the memory budget the caller waits for a free buffer, unless
+         * there is none at all */
+        pool->overcommit = (r == 0);
         ret = pool->buffer_alloc_function (pool->buffer_alloc_function_ctx, r);
         if (ret) {
           pool->buf_tracking[r].buf = ret;
@@ -506,6 +713,12 @@ gst_vpe_buffer_pool_destroy (GstVpeBufferPool * pool)
   GST_VPE_BUFFER_POOL_LOCK (pool);
   gst_buffer_pool_set_active (GST_BUFFER_POOL (pool), FALSE);
   pool->shutting_down = TRUE;
+  gst_vpe_buffer_pool_unstash (pool);
+  g_queue_clear (&pool->queued);
+  if (pool->reqbuf_count) {
+    close (pool->video_fd);
+    pool->reqbuf_count = 0;
+  }
 
   for (i = 0; i < pool->buffer_count; i++) {
     buf = pool->buf_tracking[i].buf;
@@ -515,6 +728,7 @@ gst_vpe_buffer_pool_destroy (GstVpeBufferPool * pool)
     pool->buf_tracking[i].state = BUF_ALLOCATED;
     q_cnt = pool->buf_tracking[i].q_cnt;
     pool->buf_tracking[i].q_cnt = 0;
+    gst_vpe_buffer_pool_unpin (pool, i);
     GST_VPE_BUFFER_POOL_UNLOCK (pool);
     while (q_cnt--)
       gst_buffer_unref (GST_BUFFER (buf));
@@ -548,6 +762,65 @@ stream_off (int fd, int type)
   return TRUE;
 }
 
+static gboolean
+gst_vpe_buffer_pool_reqbufs (GstVpeBufferPool * pool, int count)
+{
+  struct v4l2_requestbuffers reqbuf;
+  int r;
+
+  bzero (&reqbuf, sizeof (reqbuf));
+  reqbuf.count = count;
+  reqbuf.type = pool->v4l2_type;
+  reqbuf.memory = pool->memory;
+
+  r = ioctl (pool->video_fd, VIDIOC_REQBUFS, &reqbuf);
+  if (r < 0) {
+    VPE_ERROR ("VIDIOC_REQBUFS (%s) failed",
+        pool->output_port ? "output" : "input");
+    return FALSE;
+  } else if (reqbuf.count != count) {
+    VPE_ERROR ("REQBUFS asked: %d, got: %d", count, reqbuf.count);
+    return FALSE;
+  }
+  pool->reqbuf_count = count;
+  return TRUE;
+}
+
+/* Driver allocated (V4L2_MEMORY_MMAP) buffers have to exist before the
+ * pool can hand them out, so they are requested ahead of streaming.
+ */
+gboolean
+gst_vpe_buffer_pool_request_buffers (GstVpeBufferPool * pool, int video_fd,
+    int count)
+{
+  gboolean ret;
+
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  pool->video_fd = dup (video_fd);
+  ret = gst_vpe_buffer_pool_reqbufs (pool, count);
+  if (!ret) {
+    close (pool->video_fd);
+    pool->video_fd = -1;
+  }
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+  return ret;
+}
+
+/* Let go of the driver buffers kept over a stream off, and of our handle
+ * on the device. The next stream on requests them again.
+ */
+void
+gst_vpe_buffer_pool_release_driver (GstVpeBufferPool * pool)
+{
+  GST_VPE_BUFFER_POOL_LOCK (pool);
+  if (!pool->streaming && pool->reqbuf_count) {
+    close (pool->video_fd);
+    pool->video_fd = -1;
+    pool->reqbuf_count = 0;
+  }
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+}
+
 gboolean
 gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
     gboolean streaming, gboolean interlaced)
@@ -555,7 +828,6 @@ gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
   gboolean ret = FALSE;
   int i, q_cnt, r, index;
   GstBuffer *buf;
-  struct v4l2_requestbuffers reqbuf;
   struct v4l2_buffer buffer;
   struct v4l2_plane buf_planes[2];
   int req_buf_count;
@@ -564,52 +836,59 @@ gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
 
   GST_VPE_BUFFER_POOL_LOCK (pool);
   if (streaming && !pool->streaming) {
-    pool->video_fd = dup (video_fd);
     pool->interlaced = interlaced;
-    bzero (&reqbuf, sizeof (reqbuf));
     req_buf_count = pool->buffer_count;
-    if (!pool->output_port) {
-      req_buf_count = req_buf_count * 3;
-      if (req_buf_count > MAX_REQBUF_CNT) {
-        req_buf_count = MAX_REQBUF_CNT;
+    if (pool->reqbuf_count) {
+      /* Driver buffers already requested and queried, or kept from the
+       * last stream off */
+      req_buf_count = 0;
+    } else {
+      pool->video_fd = dup (video_fd);
+      if (!pool->output_port) {
+        if (pool->memory == V4L2_MEMORY_MMAP)
+          req_buf_count = pool->min_buffer_count;
+        else
+          req_buf_count = req_buf_count * 3;
+        if (req_buf_count > MAX_REQBUF_CNT) {
+          req_buf_count = MAX_REQBUF_CNT;
+        }
+      }
+      if (!gst_vpe_buffer_pool_reqbufs (pool, req_buf_count)) {
+        /* Nothing is kept, gst_vpe_buffer_pool_release_driver() would not
+         * close it */
+        close (pool->video_fd);
+        pool->video_fd = -1;
+        ret = FALSE;
+        goto DONE;
       }
-    }
-    reqbuf.count = req_buf_count;
-    reqbuf.type = pool->v4l2_type;
-    reqbuf.memory = V4L2_MEMORY_DMABUF;
-
-    r = ioctl (pool->video_fd, VIDIOC_REQBUFS, &reqbuf);
-    if (r < 0) {
-      VPE_ERROR ("VIDIOC_REQBUFS (input) failed");
-      ret = FALSE;
-      goto DONE;
-    } else if (reqbuf.count != req_buf_count) {
-      VPE_ERROR ("REQBUFS asked: %d, got: %d", req_buf_count, reqbuf.count);
-      ret = FALSE;
-      goto DONE;
     }
 
     vbuf = gst_buffer_get_vpe_buffer_priv (pool, pool->buf_tracking[0].buf);    //gets appropriately sized buffer from gstvpebuffer.c
     if (vbuf != NULL) {
-      printf ("gstvpebufferpool:586, vbuf size = %d\n", vbuf->size);
+      VPE_LOG ("vbuf size = %d", vbuf->size);
     } else {
-      printf ("gstvpebufferpool:586, vbuf == NULL\n");  //debug code
+      VPE_LOG ("no vbuf, driver allocated buffers");
+      /* Driver allocated input buffers are created on demand */
+      req_buf_count = 0;
+    }
+    if (vbuf) {
+      buffer = vbuf->v4l2_buf;
+      buffer.m.planes = buf_planes;
+      buf_planes[0] = vbuf->v4l2_planes[0];
+      buf_planes[1] = vbuf->v4l2_planes[1];
     }
-    buffer = vbuf->v4l2_buf;
-    buffer.m.planes = buf_planes;
-    buf_planes[0] = vbuf->v4l2_planes[0];
-    buf_planes[1] = vbuf->v4l2_planes[1];
 
-    printf ("gstvpebufferpool.c:gst_vpe_buffer_pool_set_streaming: req_buf_count: %d, reqbuf.count: %d\n", req_buf_count, reqbuf.count);        //debug code
+    VPE_LOG ("req_buf_count: %d", req_buf_count);
     for (i = 0; i < req_buf_count; i++) {
       //printf("gstvpebufferpool.c:gst_vpe_buffer_pool_set_streaming: &buffer: %p\n", buffer); //debug code
       buffer.index = i;
       //printf("GstVpeBufferPool:600, pool->video_fd = %d\n", pool->video_fd);
-      ret = ioctl (pool->video_fd, VIDIOC_QUERYBUF, &buffer);
-      if (ret < 0) {
+      r = ioctl (pool->video_fd, VIDIOC_QUERYBUF, &buffer);
+      if (r < 0) {
         VPE_ERROR ("Cant query buffers");
         fprintf (stderr, "buffer query error: %s\n", strerror (errno));
-        return FALSE;
+        ret = FALSE;
+        goto DONE;
       }
       VPE_DEBUG ("query buf %s, index = %d, fd = %d, plane[0], size = %d, "
           "plane[1] size = %d", (pool->output_port) ? "output" : "input",
@@ -618,7 +897,7 @@ gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
     }
 
     if (!pool->output_port)
-      gst_vpe_buffer_pool_free_index_list_init (pool, req_buf_count);
+      gst_vpe_buffer_pool_free_index_list_init (pool, pool->reqbuf_count);
 
     if (pool->output_port) {
       for (i = 0; i < pool->buffer_count; i++) {
@@ -627,10 +906,12 @@ gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
         if (pool->buf_tracking[i].state != BUF_FREE)
           continue;
         vbuf->v4l2_planes[0].bytesused =
-            pool->format->fmt.pix_mp.plane_fmt[0].sizeimage;
+            pool->format->fmt.pix_mp.plane_fmt[0].sizeimage +
+            vbuf->v4l2_planes[0].data_offset;
         vbuf->v4l2_planes[0].length = vbuf->v4l2_planes[0].bytesused;
         vbuf->v4l2_planes[1].bytesused =
-            pool->format->fmt.pix_mp.plane_fmt[1].sizeimage;
+            pool->format->fmt.pix_mp.plane_fmt[1].sizeimage +
+            vbuf->v4l2_planes[1].data_offset;
         vbuf->v4l2_planes[1].length = vbuf->v4l2_planes[1].bytesused;
         /* QUEUE all free buffers into the driver */
         r = ioctl (pool->video_fd, VIDIOC_QBUF, &vbuf->v4l2_buf);
@@ -638,34 +919,42 @@ gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
           VPE_ERROR ("vpebufferpool: op QBUF failed: %s, index = %d",
               strerror (errno), vbuf->v4l2_buf.index);
           ret = FALSE;
-          goto DONE;
+          goto UNQUEUE;
         }
         VPE_DEBUG ("vpebufferpool: op QBUF succeeded: index = %d",
             vbuf->v4l2_buf.index);
         pool->buf_tracking[i].state = BUF_WITH_DRIVER;
         pool->buf_tracking[i].q_cnt = 1;
+        g_queue_push_tail (&pool->queued, pool->buf_tracking[i].buf);
       }
     }
     VPE_DEBUG ("Start streaming for type: %d", pool->v4l2_type);
-    pool->streaming = streaming;
-
     ret = stream_on (pool->video_fd, pool->v4l2_type);
+    if (!ret)
+      goto UNQUEUE;
+    pool->streaming = streaming;
   } else if (pool->streaming && !streaming) {
     VPE_DEBUG ("Stop streaming for type: %d", pool->v4l2_type);
     pool->streaming = streaming;
     ret = stream_off (pool->video_fd, pool->v4l2_type);
-    close (pool->video_fd);
+    /* The driver keeps the buffers it allocated, for the next stream on */
+    gst_vpe_buffer_pool_unstash (pool);
     /* After stream off, free driver buffers */
     for (i = 0; i < pool->buffer_count; i++) {
       if (pool->buf_tracking[i].state == BUF_WITH_DRIVER) {
         buf = pool->buf_tracking[i].buf;
         if (pool->output_port) {
+          GstVpeFenceMeta *meta = gst_buffer_get_vpe_fence_meta (buf);
+          /* Frames pushed ahead will not come, release their consumer */
+          if (meta)
+            gst_vpe_fence_signal (meta->fence);
           pool->buf_tracking[i].state = BUF_FREE;
           g_assert (pool->buf_tracking[i].q_cnt == 1);
         } else {
           pool->buf_tracking[i].state = BUF_ALLOCATED;
           q_cnt = pool->buf_tracking[i].q_cnt;
           pool->buf_tracking[i].q_cnt = 0;
+          gst_vpe_buffer_pool_unpin (pool, i);
           GST_VPE_BUFFER_POOL_UNLOCK (pool);
           while (q_cnt--)
             gst_buffer_unref (GST_BUFFER (buf));
@@ -673,11 +962,29 @@ gst_vpe_buffer_pool_set_streaming (GstVpeBufferPool * pool, int video_fd,
         }
       }
     }
+    /* Nothing is with the driver any more, buffers reserved but never
+     * queued are let go too */
+    for (i = 0; i < pool->buffer_count; i++)
+      gst_vpe_buffer_pool_unpin (pool, i);
+    g_queue_clear (&pool->queued);
     pool->last_field_pushed = 0;
   }
 DONE:
   GST_VPE_BUFFER_POOL_UNLOCK (pool);
   return ret;
+
+UNQUEUE:
+  /* Stream on failed: a stream off takes back the buffers queued so far,
+   * the driver buffers stay requested until released */
+  stream_off (pool->video_fd, pool->v4l2_type);
+  for (i = 0; i < pool->buffer_count; i++)
+    if (pool->output_port && pool->buf_tracking[i].state == BUF_WITH_DRIVER) {
+      pool->buf_tracking[i].state = BUF_FREE;
+      pool->buf_tracking[i].q_cnt = 0;
+    }
+  g_queue_clear (&pool->queued);
+  GST_VPE_BUFFER_POOL_UNLOCK (pool);
+  return FALSE;
 }
 
 static GstFlowReturn
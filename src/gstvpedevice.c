@@ -0,0 +1,138 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* The omap_device shared by all the VPE instances of the process.
+ *
+ * It is created by the first instance that needs it. When the last one
+ * lets it go, it is kept for a grace period, so that pipelines that are
+ * stopped and started again do not go through dce_deinit and dce_init.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstvpe.h"
+
+static GMutex device_lock;
+static GCond device_cond;
+static struct omap_device *device = NULL;
+static gint device_users = 0;
+static guint device_grace_period = 0;   /* ms */
+static gint64 device_deadline = 0;      /* When an unused device goes away */
+static gboolean device_reaper = FALSE;  /* The reaper thread is running */
+
+/* Called with the device lock */
+static void
+gst_vpe_device_free (void)
+{
+  dce_deinit (device);
+  device = NULL;
+  VPE_DEBUG ("dce_deinit done");
+}
+
+static gpointer
+gst_vpe_device_reaper (gpointer data)
+{
+  g_mutex_lock (&device_lock);
+  while (device && device_users == 0) {
+    if (!g_cond_wait_until (&device_cond, &device_lock, device_deadline)
+        && device && device_users == 0
+        && g_get_monotonic_time () >= device_deadline)
+      gst_vpe_device_free ();
+  }
+  device_reaper = FALSE;
+  g_mutex_unlock (&device_lock);
+  return NULL;
+}
+
+struct omap_device *
+gst_vpe_device_get (void)
+{
+  struct omap_device *dev;
+
+  g_mutex_lock (&device_lock);
+  if (device == NULL) {
+    device = dce_init ();
+    if (device)
+      VPE_DEBUG ("dce_init done");
+    else
+      VPE_ERROR ("dce_init failed");
+  }
+  if (device) {
+    device_users++;
+    /* Stop a pending teardown */
+    g_cond_signal (&device_cond);
+  }
+  dev = device;
+  g_mutex_unlock (&device_lock);
+  return dev;
+}
+
+void
+gst_vpe_device_put (struct omap_device *dev)
+{
+  GThread *thread;
+
+  g_mutex_lock (&device_lock);
+  if (dev != device || device_users <= 0) {
+    g_mutex_unlock (&device_lock);
+    g_warn_if_reached ();
+    return;
+  }
+  if (--device_users == 0) {
+    if (device_grace_period == 0) {
+      gst_vpe_device_free ();
+    } else {
+      device_deadline = g_get_monotonic_time () +
+          device_grace_period * G_TIME_SPAN_MILLISECOND;
+      g_cond_signal (&device_cond);
+      if (!device_reaper) {
+        thread = g_thread_try_new ("vpe-device", gst_vpe_device_reaper, NULL,
+            NULL);
+        if (thread) {
+          device_reaper = TRUE;
+          g_thread_unref (thread);
+        } else {
+          gst_vpe_device_free ();
+        }
+      }
+    }
+  }
+  g_mutex_unlock (&device_lock);
+}
+
+void
+gst_vpe_device_set_grace_period (guint ms)
+{
+  g_mutex_lock (&device_lock);
+  device_grace_period = ms;
+  g_mutex_unlock (&device_lock);
+}
+
+guint
+gst_vpe_device_get_grace_period (void)
+{
+  guint ms;
+
+  g_mutex_lock (&device_lock);
+  ms = device_grace_period;
+  g_mutex_unlock (&device_lock);
+  return ms;
+}
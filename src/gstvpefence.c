@@ -0,0 +1,187 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Completion fences of the output buffers pushed before the VPE is done
+ * writing them.
+ *
+ * V4L2 hands out no fence for a queued CAPTURE buffer, so these are
+ * software fences: an eventfd, signalled by the dequeue loop once the
+ * frame is back from the driver. Like a sync_file, the fd polls readable
+ * once the fence is signalled, so that a consumer waiting on sync_files
+ * can wait on these the same way. They double as the mock fences to test
+ * fence aware elements without kernel support.
+ *
+ * The fence travels downstream in a GstVpeFenceMeta. Upstream elements
+ * may attach one to the buffers they give us, which are then waited for
+ * before the buffer is queued.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "gstvpe.h"
+
+struct _GstVpeFence
+{
+  gint refcount;
+  gint signalled;               /* Atomic */
+  gint fd;
+};
+
+/* A new fence, not signalled. NULL if no eventfd is available. */
+GstVpeFence *
+gst_vpe_fence_new (void)
+{
+  GstVpeFence *fence;
+  gint fd;
+
+  fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0) {
+    VPE_WARNING ("Cannot create a fence: %s", g_strerror (errno));
+    return NULL;
+  }
+  fence = g_new0 (GstVpeFence, 1);
+  fence->refcount = 1;
+  fence->fd = fd;
+  return fence;
+}
+
+GstVpeFence *
+gst_vpe_fence_ref (GstVpeFence * fence)
+{
+  g_atomic_int_inc (&fence->refcount);
+  return fence;
+}
+
+void
+gst_vpe_fence_unref (GstVpeFence * fence)
+{
+  if (g_atomic_int_dec_and_test (&fence->refcount)) {
+    close (fence->fd);
+    g_free (fence);
+  }
+}
+
+void
+gst_vpe_fence_signal (GstVpeFence * fence)
+{
+  guint64 one = 1;
+
+  if (!g_atomic_int_compare_and_exchange (&fence->signalled, FALSE, TRUE))
+    return;
+  /* Nobody reads the counter, the fd stays readable */
+  if (write (fence->fd, &one, sizeof (one)) != sizeof (one))
+    VPE_WARNING ("Cannot signal fence %d: %s", fence->fd, g_strerror (errno));
+}
+
+gboolean
+gst_vpe_fence_is_signalled (GstVpeFence * fence)
+{
+  return g_atomic_int_get (&fence->signalled);
+}
+
+/* Wait up to timeout ms for the fence. Returns whether it is signalled. */
+gboolean
+gst_vpe_fence_wait (GstVpeFence * fence, gint timeout)
+{
+  struct pollfd pfd;
+  gint r;
+
+  if (gst_vpe_fence_is_signalled (fence))
+    return TRUE;
+  pfd.fd = fence->fd;
+  pfd.events = POLLIN;
+  do {
+    pfd.revents = 0;
+    r = poll (&pfd, 1, timeout);
+  } while (r < 0 && errno == EINTR);
+  return r > 0;
+}
+
+/* The fd to poll for the fence, owned by the fence */
+gint
+gst_vpe_fence_get_fd (GstVpeFence * fence)
+{
+  return fence->fd;
+}
+
+GType
+gst_vpe_fence_meta_api_get_type (void)
+{
+  static volatile GType type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register ("GstVpeFenceMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return type;
+}
+
+static gboolean
+gst_vpe_fence_meta_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
+{
+  ((GstVpeFenceMeta *) meta)->fence = NULL;
+  ((GstVpeFenceMeta *) meta)->fd = -1;
+  return TRUE;
+}
+
+static void
+gst_vpe_fence_meta_free (GstMeta * meta, GstBuffer * buffer)
+{
+  GstVpeFenceMeta *fmeta = (GstVpeFenceMeta *) meta;
+
+  if (fmeta->fence)
+    gst_vpe_fence_unref (fmeta->fence);
+}
+
+const GstMetaInfo *
+gst_vpe_fence_meta_get_info (void)
+{
+  static const GstMetaInfo *info = NULL;
+
+  if (g_once_init_enter (&info)) {
+    const GstMetaInfo *meta = gst_meta_register (GST_VPE_FENCE_META_API_TYPE,
+        "GstVpeFenceMeta", sizeof (GstVpeFenceMeta), gst_vpe_fence_meta_init,
+        gst_vpe_fence_meta_free, (GstMetaTransformFunction) NULL);
+    g_once_init_leave (&info, meta);
+  }
+  return info;
+}
+
+/* Attach fence to buf, which takes a reference. buf must be writable. */
+GstVpeFenceMeta *
+gst_buffer_add_vpe_fence_meta (GstBuffer * buf, GstVpeFence * fence)
+{
+  GstVpeFenceMeta *meta;
+
+  meta = (GstVpeFenceMeta *) gst_buffer_add_meta (buf,
+      gst_vpe_fence_meta_get_info (), NULL);
+  if (meta) {
+    meta->fence = gst_vpe_fence_ref (fence);
+    meta->fd = fence->fd;
+  }
+  return meta;
+}
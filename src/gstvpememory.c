@@ -0,0 +1,139 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Process wide accounting of the memory used by all the VPE instances.
+ *
+ * Buffers allocated by the pools are counted for as long as they exist.
+ * Imported buffers are counted while they are queued in the driver, since
+ * this is when they are pinned in TILER. Once the budget is reached,
+ * reservations fail and the callers wait or use fewer buffers instead of
+ * running into QBUF failures.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstvpe.h"
+
+static GMutex memory_lock;
+static guint64 memory_budget = 0;       /* 0 is unlimited */
+static guint64 memory_allocated = 0;
+static guint64 memory_pinned = 0;
+static guint memory_pinned_buffers = 0;
+
+static gboolean
+gst_vpe_memory_fits (gsize size, gboolean force)
+{
+  if (!memory_budget ||
+      memory_allocated + memory_pinned + size <= memory_budget)
+    return TRUE;
+  if (force) {
+    VPE_WARNING ("Going over the memory budget of %" G_GUINT64_FORMAT
+        " bytes, %" G_GUINT64_FORMAT " in use", memory_budget,
+        memory_allocated + memory_pinned);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/* Account size bytes of a new allocation. If force is set the allocation
+ * is accounted even if this goes over the budget.
+ */
+gboolean
+gst_vpe_memory_reserve (gsize size, gboolean force)
+{
+  gboolean ret;
+
+  g_mutex_lock (&memory_lock);
+  ret = gst_vpe_memory_fits (size, force);
+  if (ret)
+    memory_allocated += size;
+  g_mutex_unlock (&memory_lock);
+  return ret;
+}
+
+void
+gst_vpe_memory_release (gsize size)
+{
+  g_mutex_lock (&memory_lock);
+  g_warn_if_fail (memory_allocated >= size);
+  memory_allocated -= MIN (memory_allocated, size);
+  g_mutex_unlock (&memory_lock);
+}
+
+/* Account an imported buffer of size bytes queued into the driver */
+gboolean
+gst_vpe_memory_pin (gsize size, gboolean force)
+{
+  gboolean ret;
+
+  g_mutex_lock (&memory_lock);
+  ret = gst_vpe_memory_fits (size, force);
+  if (ret) {
+    memory_pinned += size;
+    memory_pinned_buffers++;
+  }
+  g_mutex_unlock (&memory_lock);
+  return ret;
+}
+
+void
+gst_vpe_memory_unpin (gsize size)
+{
+  g_mutex_lock (&memory_lock);
+  g_warn_if_fail (memory_pinned >= size && memory_pinned_buffers > 0);
+  memory_pinned -= MIN (memory_pinned, size);
+  if (memory_pinned_buffers)
+    memory_pinned_buffers--;
+  g_mutex_unlock (&memory_lock);
+}
+
+void
+gst_vpe_memory_set_budget (guint64 budget)
+{
+  g_mutex_lock (&memory_lock);
+  memory_budget = budget;
+  g_mutex_unlock (&memory_lock);
+}
+
+guint64
+gst_vpe_memory_get_budget (void)
+{
+  guint64 budget;
+
+  g_mutex_lock (&memory_lock);
+  budget = memory_budget;
+  g_mutex_unlock (&memory_lock);
+  return budget;
+}
+
+/* Bytes in use, and optionally the number of pinned imported buffers */
+guint64
+gst_vpe_memory_get_usage (guint * pinned_buffers)
+{
+  guint64 usage;
+
+  g_mutex_lock (&memory_lock);
+  usage = memory_allocated + memory_pinned;
+  if (pinned_buffers)
+    *pinned_buffers = memory_pinned_buffers;
+  g_mutex_unlock (&memory_lock);
+  return usage;
+}
@@ -0,0 +1,142 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Background teardown of what the VPE instances leave behind.
+ *
+ * Freeing the buffer objects of the pools and closing the video device,
+ * which releases the driver queues, take long enough to show in every
+ * state change. The instances hand them to a reaper thread instead. It
+ * runs the jobs in the order they came, so that the omap device is only
+ * let go after the buffers allocated from it, and exits once it has none
+ * left. A new instance waits for the jobs of the device it is about to
+ * open, so that it does not compete with the previous stream for the
+ * driver and memory, but not for the other devices of a pool.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstvpe.h"
+
+typedef struct
+{
+  gchar *key;
+  GDestroyNotify func;
+  gpointer data;
+} GstVpeReapJob;
+
+static GMutex reaper_lock;
+static GCond reaper_cond;
+static GQueue reaper_jobs = G_QUEUE_INIT;
+static gboolean reaper_running = FALSE; /* The reaper thread is running */
+static GHashTable *reaper_pending;      /* Jobs not done yet, per key */
+
+/* Called with the reaper lock */
+static guint
+gst_vpe_reaper_pending (const gchar * key)
+{
+  return reaper_pending ?
+      GPOINTER_TO_UINT (g_hash_table_lookup (reaper_pending, key)) : 0;
+}
+
+/* Called with the reaper lock */
+static void
+gst_vpe_reaper_count (const gchar * key, gint delta)
+{
+  guint n;
+
+  if (!key)
+    return;
+  if (!reaper_pending)
+    reaper_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+        NULL);
+  n = gst_vpe_reaper_pending (key) + delta;
+  if (n)
+    g_hash_table_insert (reaper_pending, g_strdup (key), GUINT_TO_POINTER (n));
+  else
+    g_hash_table_remove (reaper_pending, key);
+}
+
+static gpointer
+gst_vpe_reaper (gpointer data)
+{
+  GstVpeReapJob *job;
+  gint64 start;
+
+  g_mutex_lock (&reaper_lock);
+  while (NULL != (job = (GstVpeReapJob *) g_queue_pop_head (&reaper_jobs))) {
+    g_mutex_unlock (&reaper_lock);
+    start = g_get_monotonic_time ();
+    job->func (job->data);
+    VPE_DEBUG ("Reaped %p of %s in %" G_GINT64_FORMAT " us", job->data,
+        GST_STR_NULL (job->key), g_get_monotonic_time () - start);
+    g_mutex_lock (&reaper_lock);
+    gst_vpe_reaper_count (job->key, -1);
+    g_cond_broadcast (&reaper_cond);
+    g_free (job->key);
+    g_free (job);
+  }
+  reaper_running = FALSE;
+  g_cond_broadcast (&reaper_cond);
+  g_mutex_unlock (&reaper_lock);
+  return NULL;
+}
+
+/* Call func on data from the reaper thread, after the jobs before it. key
+ * names the device the job releases, for gst_vpe_reaper_join(), or is
+ * NULL.
+ */
+void
+gst_vpe_reap (const gchar * key, GDestroyNotify func, gpointer data)
+{
+  GstVpeReapJob *job;
+  GThread *thread;
+
+  g_mutex_lock (&reaper_lock);
+  if (!reaper_running) {
+    thread = g_thread_try_new ("vpe-reaper", gst_vpe_reaper, NULL, NULL);
+    if (!thread) {
+      /* Nothing is pending, it may as well be done here */
+      g_mutex_unlock (&reaper_lock);
+      func (data);
+      return;
+    }
+    reaper_running = TRUE;
+    g_thread_unref (thread);
+  }
+  job = g_new (GstVpeReapJob, 1);
+  job->key = g_strdup (key);
+  job->func = func;
+  job->data = data;
+  gst_vpe_reaper_count (key, 1);
+  g_queue_push_tail (&reaper_jobs, job);
+  g_mutex_unlock (&reaper_lock);
+}
+
+/* Wait until the reaper is done with the jobs handed to it for key, or
+ * with every job if key is NULL */
+void
+gst_vpe_reaper_join (const gchar * key)
+{
+  g_mutex_lock (&reaper_lock);
+  while (key ? gst_vpe_reaper_pending (key) != 0 : reaper_running)
+    g_cond_wait (&reaper_cond, &reaper_lock);
+  g_mutex_unlock (&reaper_lock);
+}
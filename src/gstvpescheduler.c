@@ -0,0 +1,290 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Process wide scheduling of the VPE instances over the hardware nodes.
+ *
+ * Each V4L2 M2M node can serve several streams, each with its own context.
+ * The instances report the frames they have in flight and how long the
+ * node takes per frame, and new streams are bound to the node of their
+ * device pool that is expected to be free first.
+ *
+ * The kernel runs the jobs of the contexts of a node round robin. To let
+ * some streams go first, every stream also has a priority and the rate at
+ * which it needs frames. A stream may only queue input while no stream of
+ * higher priority on the same node is waiting for the node or due for its
+ * next frame, and then only one frame at a time, so that lower priority
+ * streams get the time the others leave idle.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstvpe.h"
+
+/* How long a stream of unknown rate that was held back still counts as
+ * waiting without asking again */
+#define WAITING_TIMEOUT     (100 * GST_MSECOND)
+
+typedef struct
+{
+  gint in_flight;
+  guint priority;
+  GstClockTime interval;        /* Time between frames, 0 if unknown */
+  GstClockTime last_queued;
+  GstClockTime waiting;         /* Last time its input was held back by the
+                                 * scheduler, none if it was not since */
+} GstVpeStream;
+
+typedef struct
+{
+  gchar *path;
+  GHashTable *users;            /* instance -> GstVpeStream */
+  gint in_flight;               /* Sum over the users */
+  GstClockTime frame_time;      /* Moving average of the time per frame */
+} GstVpeNode;
+
+static GMutex scheduler_lock;
+static GHashTable *scheduler_nodes = NULL;      /* path -> GstVpeNode */
+
+static void
+gst_vpe_node_free (GstVpeNode * node)
+{
+  g_hash_table_destroy (node->users);
+  g_free (node->path);
+  g_free (node);
+}
+
+/* Called with the scheduler lock */
+static GstVpeNode *
+gst_vpe_node_lookup (const gchar * path, gboolean create)
+{
+  GstVpeNode *node;
+
+  if (!scheduler_nodes)
+    scheduler_nodes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+        (GDestroyNotify) gst_vpe_node_free);
+  node = g_hash_table_lookup (scheduler_nodes, path);
+  if (!node && create) {
+    node = g_new0 (GstVpeNode, 1);
+    node->path = g_strdup (path);
+    node->users = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+        NULL, g_free);
+    g_hash_table_insert (scheduler_nodes, node->path, node);
+  }
+  return node;
+}
+
+/* Time until the node is done with the work it has, and one more frame
+ * per stream */
+static guint64
+gst_vpe_node_load (GstVpeNode * node)
+{
+  return (guint64) (node->in_flight + g_hash_table_size (node->users)) *
+      MAX (node->frame_time, 1);
+}
+
+/* Bind user to the least loaded node of pool, a comma separated list of
+ * device paths. Returns the path of the node, to be freed.
+ */
+gchar *
+gst_vpe_node_acquire (const gchar * pool, gpointer user)
+{
+  gchar **paths = g_strsplit (pool, ",", -1);
+  GstVpeNode *node, *best = NULL;
+  GstVpeStream *stream;
+  gchar *ret = NULL;
+  gint i;
+
+  g_mutex_lock (&scheduler_lock);
+  for (i = 0; paths[i]; i++) {
+    g_strstrip (paths[i]);
+    if (!paths[i][0])
+      continue;
+    node = gst_vpe_node_lookup (paths[i], TRUE);
+    if (!best || gst_vpe_node_load (node) < gst_vpe_node_load (best))
+      best = node;
+  }
+  if (best) {
+    stream = g_new0 (GstVpeStream, 1);
+    stream->last_queued = GST_CLOCK_TIME_NONE;
+    stream->waiting = GST_CLOCK_TIME_NONE;
+    g_hash_table_insert (best->users, user, stream);
+    ret = g_strdup (best->path);
+    VPE_DEBUG ("Using %s, %d streams, %d frames in flight, %"
+        GST_TIME_FORMAT " per frame", best->path,
+        g_hash_table_size (best->users), best->in_flight,
+        GST_TIME_ARGS (best->frame_time));
+  }
+  g_mutex_unlock (&scheduler_lock);
+  g_strfreev (paths);
+  return ret;
+}
+
+void
+gst_vpe_node_release (const gchar * path, gpointer user)
+{
+  GstVpeNode *node;
+  GstVpeStream *stream;
+
+  g_mutex_lock (&scheduler_lock);
+  node = gst_vpe_node_lookup (path, FALSE);
+  if (node && (stream = g_hash_table_lookup (node->users, user))) {
+    node->in_flight -= stream->in_flight;
+    g_hash_table_remove (node->users, user);
+  }
+  g_mutex_unlock (&scheduler_lock);
+}
+
+/* Report the frames user has in flight, and the time the node took for
+ * the last frame if frame_time is valid */
+void
+gst_vpe_node_update (const gchar * path, gpointer user, gint in_flight,
+    GstClockTime frame_time)
+{
+  GstVpeNode *node;
+  GstVpeStream *stream;
+
+  g_mutex_lock (&scheduler_lock);
+  node = gst_vpe_node_lookup (path, FALSE);
+  if (node && (stream = g_hash_table_lookup (node->users, user))) {
+    node->in_flight += in_flight - stream->in_flight;
+    stream->in_flight = in_flight;
+    if (GST_CLOCK_TIME_IS_VALID (frame_time))
+      node->frame_time = node->frame_time ?
+          (node->frame_time * 7 + frame_time) / 8 : frame_time;
+  }
+  g_mutex_unlock (&scheduler_lock);
+}
+
+/* Set the priority of user, higher goes first, and the time between the
+ * frames it needs */
+void
+gst_vpe_node_set_schedule (const gchar * path, gpointer user, guint priority,
+    GstClockTime interval)
+{
+  GstVpeNode *node;
+  GstVpeStream *stream;
+
+  g_mutex_lock (&scheduler_lock);
+  node = gst_vpe_node_lookup (path, FALSE);
+  if (node && (stream = g_hash_table_lookup (node->users, user))) {
+    stream->priority = priority;
+    stream->interval = interval;
+  }
+  g_mutex_unlock (&scheduler_lock);
+}
+
+/* Called with the scheduler lock */
+static gboolean
+gst_vpe_stream_is_waiting (GstVpeStream * stream, GstClockTime now)
+{
+  /* A stream that stopped asking has given up, like one that missed its
+   * next frame by a whole interval */
+  return GST_CLOCK_TIME_IS_VALID (stream->waiting) &&
+      now < stream->waiting +
+      (stream->interval ? 2 * stream->interval : WAITING_TIMEOUT);
+}
+
+/* Called with the scheduler lock */
+static gboolean
+gst_vpe_stream_is_due (GstVpeNode * node, GstVpeStream * stream,
+    GstClockTime now)
+{
+  if (gst_vpe_stream_is_waiting (stream, now))
+    return TRUE;
+  if (!stream->interval || !GST_CLOCK_TIME_IS_VALID (stream->last_queued))
+    return FALSE;
+  /* A frame queued now would still be in the way of its next one. A
+   * stream that missed its next frame by a whole interval has stopped. */
+  return now + node->frame_time >= stream->last_queued + stream->interval
+      && now < stream->last_queued + 2 * stream->interval;
+}
+
+/* Called with the scheduler lock */
+static gboolean
+gst_vpe_stream_is_active (GstVpeStream * stream, GstClockTime now)
+{
+  if (gst_vpe_stream_is_waiting (stream, now) || stream->in_flight > 0)
+    return TRUE;
+  return stream->interval && GST_CLOCK_TIME_IS_VALID (stream->last_queued)
+      && now < stream->last_queued + 2 * stream->interval;
+}
+
+/* Whether user, which has in_flight input frames in the driver, may queue
+ * one more. If not, the caller has to try again from its dequeue loop.
+ */
+gboolean
+gst_vpe_node_may_queue (const gchar * path, gpointer user, gint in_flight)
+{
+  GstVpeNode *node;
+  GstVpeStream *stream, *other;
+  GHashTableIter iter;
+  GstClockTime now;
+  gboolean ret = TRUE;
+
+  g_mutex_lock (&scheduler_lock);
+  node = gst_vpe_node_lookup (path, FALSE);
+  if (node && (stream = g_hash_table_lookup (node->users, user))) {
+    now = gst_util_get_timestamp ();
+    g_hash_table_iter_init (&iter, node->users);
+    while (ret && g_hash_table_iter_next (&iter, NULL, (gpointer *) & other)) {
+      if (other->priority <= stream->priority)
+        continue;
+      if (gst_vpe_stream_is_due (node, other, now))
+        ret = FALSE;
+      else if (gst_vpe_stream_is_active (other, now))
+        ret = in_flight == 0;
+    }
+    stream->waiting = ret ? GST_CLOCK_TIME_NONE : now;
+  }
+  g_mutex_unlock (&scheduler_lock);
+  return ret;
+}
+
+/* Called once user has queued a frame */
+void
+gst_vpe_node_queued (const gchar * path, gpointer user)
+{
+  GstVpeNode *node;
+  GstVpeStream *stream;
+
+  g_mutex_lock (&scheduler_lock);
+  node = gst_vpe_node_lookup (path, FALSE);
+  if (node && (stream = g_hash_table_lookup (node->users, user))) {
+    stream->waiting = GST_CLOCK_TIME_NONE;
+    stream->last_queued = gst_util_get_timestamp ();
+  }
+  g_mutex_unlock (&scheduler_lock);
+}
+
+/* Called once user no longer has input to queue, on stream off, flush
+ * or EOS, so that it does not hold back the streams below it */
+void
+gst_vpe_node_idle (const gchar * path, gpointer user)
+{
+  GstVpeNode *node;
+  GstVpeStream *stream;
+
+  g_mutex_lock (&scheduler_lock);
+  node = gst_vpe_node_lookup (path, FALSE);
+  if (node && (stream = g_hash_table_lookup (node->users, user)))
+    stream->waiting = GST_CLOCK_TIME_NONE;
+  g_mutex_unlock (&scheduler_lock);
+}
@@ -0,0 +1,258 @@
+/*
+ * GStreamer
+ * Copyright (c) 2014, Texas Instruments Incorporated
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Upload of system memory frames into the dmabufs of the input pool.
+ *
+ * The destination is write-combined memory that the CPU never reads back,
+ * so rows are copied with wide stores that bypass the cache where the
+ * instruction set has them. Large frames are split in stripes of rows that
+ * are copied in parallel.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstvpe.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define VPE_UPLOAD_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VPE_UPLOAD_SSE2 1
+#endif
+
+#define UPLOAD_MAX_THREADS   4
+#define UPLOAD_MAX_STRIPES   (UPLOAD_MAX_THREADS * GST_VIDEO_MAX_PLANES)
+
+/* Below this frame size waking up the workers costs more than it saves */
+#define UPLOAD_MT_THRESHOLD  (512 * 1024)
+
+struct _GstVpeUpload
+{
+  GThreadPool *workers;
+  gint n_threads;
+  GMutex lock;
+  GCond cond;
+  gint pending;
+};
+
+typedef struct
+{
+  GstVpeUpload *upload;
+  guint8 *dst;
+  const guint8 *src;
+  gint dst_stride, src_stride;
+  gint row_bytes, rows;
+} GstVpeUploadStripe;
+
+static inline void
+gst_vpe_copy_row (guint8 * dst, const guint8 * src, gsize n)
+{
+#if defined(VPE_UPLOAD_NEON)
+  while (n >= 64) {
+    uint8x16_t a, b, c, d;
+    __builtin_prefetch (src + 256);
+    a = vld1q_u8 (src);
+    b = vld1q_u8 (src + 16);
+    c = vld1q_u8 (src + 32);
+    d = vld1q_u8 (src + 48);
+    vst1q_u8 (dst, a);
+    vst1q_u8 (dst + 16, b);
+    vst1q_u8 (dst + 32, c);
+    vst1q_u8 (dst + 48, d);
+    src += 64;
+    dst += 64;
+    n -= 64;
+  }
+#elif defined(VPE_UPLOAD_SSE2)
+  gsize head = (-(guintptr) dst) & 15;
+
+  /* Streaming stores need an aligned destination */
+  if (head > n)
+    head = n;
+  memcpy (dst, src, head);
+  dst += head;
+  src += head;
+  n -= head;
+  while (n >= 64) {
+    __m128i a, b, c, d;
+    _mm_prefetch ((const char *) src + 256, _MM_HINT_NTA);
+    a = _mm_loadu_si128 ((const __m128i *) src);
+    b = _mm_loadu_si128 ((const __m128i *) (src + 16));
+    c = _mm_loadu_si128 ((const __m128i *) (src + 32));
+    d = _mm_loadu_si128 ((const __m128i *) (src + 48));
+    _mm_stream_si128 ((__m128i *) dst, a);
+    _mm_stream_si128 ((__m128i *) (dst + 16), b);
+    _mm_stream_si128 ((__m128i *) (dst + 32), c);
+    _mm_stream_si128 ((__m128i *) (dst + 48), d);
+    src += 64;
+    dst += 64;
+    n -= 64;
+  }
+#endif
+  memcpy (dst, src, n);
+}
+
+static void
+gst_vpe_copy_rows (GstVpeUploadStripe * s)
+{
+  guint8 *dst = s->dst;
+  const guint8 *src = s->src;
+  gint row_bytes = s->row_bytes, rows = s->rows, y;
+
+  /* Same layout on both sides, the stripe is a single run of bytes */
+  if (s->dst_stride == row_bytes && s->src_stride == row_bytes) {
+    row_bytes *= rows;
+    rows = 1;
+  }
+  for (y = 0; y < rows; y++) {
+    gst_vpe_copy_row (dst, src, row_bytes);
+    dst += s->dst_stride;
+    src += s->src_stride;
+  }
+#if defined(VPE_UPLOAD_SSE2)
+  _mm_sfence ();
+#endif
+}
+
+static void
+gst_vpe_upload_worker (gpointer data, gpointer user_data)
+{
+  GstVpeUploadStripe *s = data;
+  GstVpeUpload *upload = user_data;
+
+  gst_vpe_copy_rows (s);
+
+  g_mutex_lock (&upload->lock);
+  if (--upload->pending == 0)
+    g_cond_signal (&upload->cond);
+  g_mutex_unlock (&upload->lock);
+}
+
+GstVpeUpload *
+gst_vpe_upload_new (void)
+{
+  GstVpeUpload *upload = g_new0 (GstVpeUpload, 1);
+
+  g_mutex_init (&upload->lock);
+  g_cond_init (&upload->cond);
+  upload->n_threads = MIN (g_get_num_processors (), UPLOAD_MAX_THREADS);
+  if (upload->n_threads > 1) {
+    /* The calling thread copies one stripe itself */
+    upload->workers = g_thread_pool_new (gst_vpe_upload_worker, upload,
+        upload->n_threads - 1, TRUE, NULL);
+    if (!upload->workers)
+      upload->n_threads = 1;
+  }
+  VPE_DEBUG ("Upload with %d threads", upload->n_threads);
+  return upload;
+}
+
+void
+gst_vpe_upload_free (GstVpeUpload * upload)
+{
+  if (!upload)
+    return;
+  if (upload->workers)
+    g_thread_pool_free (upload->workers, FALSE, TRUE);
+  g_mutex_clear (&upload->lock);
+  g_cond_clear (&upload->cond);
+  g_free (upload);
+}
+
+/* Copy the frame in src into dst, repacking the rows to the strides of
+ * the destination. Both buffers are described by their GstVideoMeta if
+ * they have one, by the default layout of the format otherwise.
+ */
+gboolean
+gst_vpe_upload_frame (GstVpeUpload * upload, GstBuffer * dst,
+    GstBuffer * src, guint32 fourcc, gint width, gint height)
+{
+  GstVpeUploadStripe stripes[UPLOAD_MAX_STRIPES];
+  GstVideoFrame sframe, dframe;
+  GstVideoInfo info;
+  GstVideoFormat format;
+  gint n_stripes = 0, n_threads = 1, plane, comp, i, rows, y;
+
+  format = gst_vpe_fourcc_to_video_format (fourcc);
+  if (format == GST_VIDEO_FORMAT_UNKNOWN) {
+    VPE_ERROR ("Cannot upload format 0x%08x", fourcc);
+    return FALSE;
+  }
+  gst_video_info_set_format (&info, format, width, height);
+
+  if (!gst_video_frame_map (&sframe, &info, src, GST_MAP_READ)) {
+    VPE_ERROR ("Cannot map the system memory buffer");
+    return FALSE;
+  }
+  if (!gst_video_frame_map (&dframe, &info, dst, GST_MAP_WRITE)) {
+    VPE_ERROR ("Cannot map the input pool buffer");
+    gst_video_frame_unmap (&sframe);
+    return FALSE;
+  }
+
+  if (upload->workers && GST_VIDEO_INFO_SIZE (&info) >= UPLOAD_MT_THRESHOLD)
+    n_threads = upload->n_threads;
+
+  for (plane = 0; plane < GST_VIDEO_FRAME_N_PLANES (&dframe); plane++) {
+    /* The first component stored in the plane gives its geometry */
+    for (comp = 0; comp < GST_VIDEO_FRAME_N_COMPONENTS (&dframe); comp++)
+      if (GST_VIDEO_FRAME_COMP_PLANE (&dframe, comp) == plane)
+        break;
+    rows = GST_VIDEO_FRAME_COMP_HEIGHT (&dframe, comp);
+    for (i = 0, y = 0; i < n_threads && y < rows; i++) {
+      GstVpeUploadStripe *s = &stripes[n_stripes++];
+      gint n = (rows - y) / (n_threads - i);
+
+      s->upload = upload;
+      s->dst_stride = GST_VIDEO_FRAME_PLANE_STRIDE (&dframe, plane);
+      s->src_stride = GST_VIDEO_FRAME_PLANE_STRIDE (&sframe, plane);
+      s->dst = (guint8 *) GST_VIDEO_FRAME_PLANE_DATA (&dframe, plane) +
+          y * s->dst_stride;
+      s->src = (const guint8 *) GST_VIDEO_FRAME_PLANE_DATA (&sframe, plane) +
+          y * s->src_stride;
+      s->row_bytes = GST_VIDEO_FRAME_COMP_WIDTH (&dframe, comp) *
+          GST_VIDEO_FRAME_COMP_PSTRIDE (&dframe, comp);
+      s->rows = n;
+      y += n;
+    }
+  }
+
+  if (n_stripes > 1) {
+    upload->pending = n_stripes - 1;
+    for (i = 0; i < n_stripes - 1; i++)
+      g_thread_pool_push (upload->workers, &stripes[i], NULL);
+  }
+  gst_vpe_copy_rows (&stripes[n_stripes - 1]);
+  if (n_stripes > 1) {
+    g_mutex_lock (&upload->lock);
+    while (upload->pending > 0)
+      g_cond_wait (&upload->cond, &upload->lock);
+    g_mutex_unlock (&upload->lock);
+  }
+
+  gst_video_frame_unmap (&dframe);
+  gst_video_frame_unmap (&sframe);
+
+  gst_buffer_copy_into (dst, src,
+      GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+  return TRUE;
+}
@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <poll.h>
 
 #include <gst/gst.h>
 static int sigtermed = 0;
@@ -168,10 +169,6 @@ create_pipeline (char *arg)
           (void *) h264parse))
     printf ("Cannot connect pad-added cb\r\n");
 
-  // ================= Run
-  printf ("Set Play Mode ...\r\n");
-  gst_element_set_state (pipeline, GST_STATE_PLAYING);
-
 #if 0
   {
     GstClock *clk = gst_pipeline_get_clock (GST_PIPELINE (pipeline));
@@ -185,6 +182,550 @@ create_pipeline (char *arg)
   return pipeline;
 }
 
+static GstPadProbeReturn
+first_frame_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  g_atomic_int_set ((gint *) data, 1);
+  return GST_PAD_PROBE_REMOVE;
+}
+
+typedef void (*StartFunc) (GstElement * pipeline, gpointer data);
+
+/* Watch the sink of pipeline, call start and wait up to 10 s for the first
+ * frame to reach the sink. Returns the time it took in us, -1 without a
+ * frame.
+ */
+static gint64
+wait_first_frame (GstElement * pipeline, StartFunc start_func, gpointer data)
+{
+  GstElement *sink;
+  GstPad *pad;
+  gint done = 0;
+  gulong probe;
+  gint64 start, elapsed;
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "kmssink");
+  pad = gst_element_get_static_pad (sink, "sink");
+  probe = gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, first_frame_cb,
+      &done, NULL);
+
+  start = g_get_monotonic_time ();
+  start_func (pipeline, data);
+  while (!g_atomic_int_get (&done) &&
+      g_get_monotonic_time () - start < 10 * G_USEC_PER_SEC)
+    usleep (1000);
+  elapsed = g_get_monotonic_time () - start;
+  /* done lives on our stack */
+  if (!g_atomic_int_get (&done))
+    gst_pad_remove_probe (pad, probe);
+  gst_object_unref (pad);
+  gst_object_unref (sink);
+  return g_atomic_int_get (&done) ? elapsed : -1;
+}
+
+static void
+start_playing (GstElement * pipeline, gpointer data)
+{
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+}
+
+/* Create a pipeline, with the vpe_prop property of its vpe set to value,
+ * and play it until the first frame reaches the sink. Returns NULL after
+ * 10 s without one. If elapsed is set, it gets the time from PLAYING to
+ * the first frame.
+ */
+static GstElement *
+play_to_first_frame (char *arg, const gchar * vpe_prop, guint value,
+    gint64 * elapsed)
+{
+  GstElement *pipeline, *vpe;
+  gint64 t;
+
+  pipeline = create_pipeline (arg);
+  vpe = gst_bin_get_by_name (GST_BIN (pipeline), "vpe");
+  if (vpe) {
+    g_object_set (vpe, vpe_prop, value, NULL);
+    gst_object_unref (vpe);
+  }
+  t = wait_first_frame (pipeline, start_playing, NULL);
+  if (elapsed)
+    *elapsed = t;
+  if (t < 0) {
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (pipeline);
+    return NULL;
+  }
+  return pipeline;
+}
+
+/* Start and stop a pipeline count times, and print how long it takes from
+ * PLAYING to the first frame reaching the sink. Runs once with the omap
+ * device torn down on every stop, and once with it kept alive between runs.
+ */
+static void
+bench_start (int count, char *arg)
+{
+  static const guint grace_periods[] = { 0, 2000 };
+  GstElement *pipeline;
+  gint64 elapsed, total, min, max;
+  int i, j, frames;
+
+  for (j = 0; j < G_N_ELEMENTS (grace_periods); j++) {
+    total = max = frames = 0;
+    min = G_MAXINT64;
+    for (i = 0; i < count && !sigtermed; i++) {
+      pipeline = play_to_first_frame (arg, "device-grace-period",
+          grace_periods[j], &elapsed);
+      if (!pipeline) {
+        printf ("run %d: no frame after 10 s\n", i);
+        continue;
+      }
+      gst_element_set_state (pipeline, GST_STATE_NULL);
+      gst_object_unref (pipeline);
+      frames++;
+      total += elapsed;
+      min = MIN (min, elapsed);
+      max = MAX (max, elapsed);
+    }
+    if (frames)
+      printf ("device-grace-period=%u: start to first frame over %d runs: "
+          "min %" G_GINT64_FORMAT " us, avg %" G_GINT64_FORMAT " us, max %"
+          G_GINT64_FORMAT " us\n", grace_periods[j], frames, min,
+          total / frames, max);
+  }
+}
+
+/* Switch count times from a playing pipeline to a new one, as a playlist
+ * does, and print how long stopping the old one blocks and how long it
+ * takes from there to the first frame of the new one. Runs once with the
+ * teardown done in the state change, and once with it in the background.
+ */
+static void
+bench_switch (int count, char *arg)
+{
+  static const gboolean async[] = { FALSE, TRUE };
+  GstElement *pipeline;
+  gint64 start, stop, elapsed, stop_total, stop_max, total, max;
+  int i, j, switches;
+
+  for (j = 0; j < G_N_ELEMENTS (async); j++) {
+    stop_total = stop_max = total = max = switches = 0;
+    pipeline = play_to_first_frame (arg, "async-teardown", async[j], NULL);
+    for (i = 0; i < count && pipeline && !sigtermed; i++) {
+      start = g_get_monotonic_time ();
+      gst_element_set_state (pipeline, GST_STATE_NULL);
+      gst_object_unref (pipeline);
+      stop = g_get_monotonic_time () - start;
+      pipeline = play_to_first_frame (arg, "async-teardown", async[j], NULL);
+      elapsed = g_get_monotonic_time () - start;
+      if (!pipeline) {
+        printf ("switch %d: no frame after 10 s\n", i);
+        break;
+      }
+      switches++;
+      stop_total += stop;
+      stop_max = MAX (stop_max, stop);
+      total += elapsed;
+      max = MAX (max, elapsed);
+    }
+    if (pipeline) {
+      gst_element_set_state (pipeline, GST_STATE_NULL);
+      gst_object_unref (pipeline);
+    }
+    if (switches)
+      printf ("async-teardown=%d over %d switches: stop avg %" G_GINT64_FORMAT
+          " us, max %" G_GINT64_FORMAT " us; stop to next first frame avg %"
+          G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n", async[j],
+          switches, stop_total / switches, stop_max, total / switches, max);
+  }
+}
+
+typedef struct
+{
+  gdouble rate;
+  GstSeekFlags flags;
+} SeekArgs;
+
+static void
+start_seek (GstElement * pipeline, gpointer data)
+{
+  SeekArgs *seek = (SeekArgs *) data;
+  gint64 pos = 0;
+
+  gst_element_query_position (pipeline, GST_FORMAT_TIME, &pos);
+  if (seek->rate > 0)
+    gst_element_seek (pipeline, seek->rate, GST_FORMAT_TIME,
+        GST_SEEK_FLAG_FLUSH | seek->flags, GST_SEEK_TYPE_SET, pos,
+        GST_SEEK_TYPE_NONE, 0);
+  else
+    gst_element_seek (pipeline, seek->rate, GST_FORMAT_TIME,
+        GST_SEEK_FLAG_FLUSH | seek->flags, GST_SEEK_TYPE_SET, 0,
+        GST_SEEK_TYPE_SET, pos);
+}
+
+/* Seek and wait up to 10 s for the first frame to reach the sink */
+static gboolean
+seek_to_first_frame (GstElement * pipeline, gdouble rate, GstSeekFlags flags)
+{
+  SeekArgs seek = { rate, flags };
+
+  return wait_first_frame (pipeline, start_seek, &seek) >= 0;
+}
+
+/* Print the output size the vpe negotiated */
+static gint
+print_vpe_size (GstElement * vpe, const char *what)
+{
+  GstPad *pad = gst_element_get_static_pad (vpe, "src");
+  GstCaps *caps = gst_pad_get_current_caps (pad);
+  gint width = 0, height = 0;
+
+  if (caps) {
+    gst_structure_get_int (gst_caps_get_structure (caps, 0), "width", &width);
+    gst_structure_get_int (gst_caps_get_structure (caps, 0), "height",
+        &height);
+    gst_caps_unref (caps);
+  }
+  gst_object_unref (pad);
+  printf ("%s: %dx%d\n", what, width, height);
+  return width;
+}
+
+/* Play with trickmode-scale=2, and check that the output size is halved in
+ * a trick mode segment and in reverse playback, downstream permitting */
+static void
+bench_trick (char *arg)
+{
+  GstElement *pipeline, *vpe;
+  gint normal, trick, reverse;
+
+  pipeline = play_to_first_frame (arg, "async-teardown", TRUE, NULL);
+  if (!pipeline) {
+    printf ("no frame after 10 s\n");
+    return;
+  }
+  vpe = gst_bin_get_by_name (GST_BIN (pipeline), "vpe");
+  if (!vpe) {
+    printf ("No vpe in the pipeline\n");
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (pipeline);
+    return;
+  }
+  g_object_set (vpe, "trickmode-scale", 2, NULL);
+  sleep (1);
+  normal = print_vpe_size (vpe, "normal playback");
+  trick = reverse = 0;
+  if (seek_to_first_frame (pipeline, 2.0, GST_SEEK_FLAG_TRICKMODE |
+          GST_SEEK_FLAG_TRICKMODE_KEY_UNITS))
+    trick = print_vpe_size (vpe, "trick mode");
+  if (seek_to_first_frame (pipeline, -1.0, GST_SEEK_FLAG_ACCURATE))
+    reverse = print_vpe_size (vpe, "reverse playback");
+  printf ("trick mode %s, reverse playback %s\n",
+      trick && trick < normal ? "downscaled" : "NOT downscaled",
+      reverse && reverse < normal ? "downscaled" : "NOT downscaled");
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (vpe);
+  gst_object_unref (pipeline);
+}
+
+/* Waits of the contention bench, per phase and per access */
+#define CONTENTION_ACCESSES 3
+typedef struct
+{
+  GstElement *vpe;
+  gint phase;                   /* 0 playing, 1 changing state, -1 done */
+  gint64 total[2][CONTENTION_ACCESSES], max[2][CONTENTION_ACCESSES];
+  int n[2];
+} ContentionBench;
+
+static gpointer
+contention_reader (gpointer data)
+{
+  ContentionBench *b = (ContentionBench *) data;
+  GstStructure *stats;
+  gint64 t, wait[CONTENTION_ACCESSES];
+  guint keep = 0;
+  int phase, k;
+
+  while ((phase = g_atomic_int_get (&b->phase)) >= 0) {
+    t = g_get_monotonic_time ();
+    GST_OBJECT_LOCK (b->vpe);
+    GST_OBJECT_UNLOCK (b->vpe);
+    wait[0] = g_get_monotonic_time () - t;
+    t = g_get_monotonic_time ();
+    g_object_get (b->vpe, "stats", &stats, NULL);
+    wait[1] = g_get_monotonic_time () - t;
+    if (stats)
+      gst_structure_free (stats);
+    t = g_get_monotonic_time ();
+    g_object_get (b->vpe, "keep-every", &keep, NULL);
+    g_object_set (b->vpe, "keep-every", keep, NULL);
+    wait[2] = g_get_monotonic_time () - t;
+    for (k = 0; k < CONTENTION_ACCESSES; k++) {
+      b->total[phase][k] += wait[k];
+      b->max[phase][k] = MAX (b->max[phase][k], wait[k]);
+    }
+    b->n[phase]++;
+    usleep (100);
+  }
+  return NULL;
+}
+
+/* Play a pipeline for half the given time, then take it down and up again
+ * for the other half, while another thread takes the object lock of the
+ * VPE, reads its stats and sets a property in a loop, as property
+ * accessors and the core do. Print how long they wait on the streaming
+ * threads and on the state changes.
+ */
+static void
+bench_contention (int seconds, char *arg)
+{
+  static const char *names[CONTENTION_ACCESSES] =
+      { "object lock", "stats", "property" };
+  static const char *phases[2] = { "playing", "state changes" };
+  ContentionBench b;
+  GstElement *pipeline;
+  GThread *reader;
+  gint64 start;
+  int cycles = 0, k, p;
+
+  memset (&b, 0, sizeof (b));
+  pipeline = create_pipeline (arg);
+  b.vpe = gst_bin_get_by_name (GST_BIN (pipeline), "vpe");
+  if (!b.vpe) {
+    printf ("No vpe in the pipeline\n");
+    gst_object_unref (pipeline);
+    return;
+  }
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  reader = g_thread_new ("contention", contention_reader, &b);
+  start = g_get_monotonic_time ();
+  while (!sigtermed &&
+      g_get_monotonic_time () - start < seconds * G_USEC_PER_SEC / 2)
+    usleep (10000);
+  g_atomic_int_set (&b.phase, 1);
+  while (!sigtermed &&
+      g_get_monotonic_time () - start < seconds * G_USEC_PER_SEC) {
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    gst_element_get_state (pipeline, NULL, NULL, 5 * GST_SECOND);
+    cycles++;
+  }
+  g_atomic_int_set (&b.phase, -1);
+  g_thread_join (reader);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (b.vpe);
+  gst_object_unref (pipeline);
+  printf ("%d state change cycles\n", cycles);
+  for (p = 0; p < 2; p++)
+    for (k = 0; k < CONTENTION_ACCESSES && b.n[p]; k++)
+      printf ("%s, %s over %d reads: avg %" G_GINT64_FORMAT " us, max %"
+          G_GINT64_FORMAT " us\n", phases[p], names[k], b.n[p],
+          b.total[p][k] / b.n[p], b.max[p][k]);
+}
+
+/* What a fence aware consumer sees of the GstVpeFenceMeta, without linking
+ * the plugin: the fd polls readable once the VPE wrote the frame. */
+typedef struct
+{
+  GstMeta meta;
+  gpointer fence;
+  gint fd;
+} MockFenceMeta;
+
+typedef struct
+{
+  GType api;
+  gboolean advertise;           /* Ask for the fence meta */
+  guint frames, fenced, unsignalled, timeouts;
+  gint64 wait_total, wait_max;
+} MockFenceConsumer;
+
+/* Answer the allocation query of the vpe as a consumer that waits for
+ * fences would */
+static GstPadProbeReturn
+mock_fence_query_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  MockFenceConsumer *c = (MockFenceConsumer *) data;
+  GstQuery *query = GST_PAD_PROBE_INFO_QUERY (info);
+
+  if (c->advertise && c->api && GST_QUERY_TYPE (query) == GST_QUERY_ALLOCATION)
+    gst_query_add_allocation_meta (query, c->api, NULL);
+  return GST_PAD_PROBE_OK;
+}
+
+/* Hold each frame at the sink until its fence, if any, is signalled */
+static GstPadProbeReturn
+mock_fence_buffer_cb (GstPad * pad, GstPadProbeInfo * info, gpointer data)
+{
+  MockFenceConsumer *c = (MockFenceConsumer *) data;
+  GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  MockFenceMeta *meta;
+  struct pollfd pfd;
+  gint64 t, wait;
+
+  c->frames++;
+  meta = c->api ? (MockFenceMeta *) gst_buffer_get_meta (buf, c->api) : NULL;
+  if (!meta || meta->fd < 0)
+    return GST_PAD_PROBE_OK;
+  c->fenced++;
+  pfd.fd = meta->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll (&pfd, 1, 0) > 0)
+    return GST_PAD_PROBE_OK;
+  c->unsignalled++;
+  t = g_get_monotonic_time ();
+  pfd.revents = 0;
+  if (poll (&pfd, 1, 1000) <= 0)
+    c->timeouts++;
+  wait = g_get_monotonic_time () - t;
+  c->wait_total += wait;
+  c->wait_max = MAX (c->wait_max, wait);
+  return GST_PAD_PROBE_OK;
+}
+
+/* Play a pipeline with fence-mode=early for the given time, once with a
+ * consumer that does not know the fence meta, and once with a mock one
+ * that asks for it and polls the fence of each frame before passing it
+ * on. Print how many frames went out ahead, and how long they waited.
+ */
+static void
+bench_fences (int seconds, char *arg)
+{
+  GstElement *pipeline, *vpe, *sink;
+  GstStructure *stats;
+  GstPad *pad;
+  MockFenceConsumer c;
+  guint64 early;
+  gint64 start;
+  int run;
+
+  for (run = 0; run < 2 && !sigtermed; run++) {
+    memset (&c, 0, sizeof (c));
+    c.advertise = run == 1;
+    pipeline = create_pipeline (arg);
+    vpe = gst_bin_get_by_name (GST_BIN (pipeline), "vpe");
+    if (!vpe) {
+      printf ("No vpe in the pipeline\n");
+      gst_object_unref (pipeline);
+      return;
+    }
+    gst_util_set_object_arg (G_OBJECT (vpe), "fence-mode", "early");
+    /* Registered with the plugin */
+    c.api = g_type_from_name ("GstVpeFenceMetaAPI");
+    pad = gst_element_get_static_pad (vpe, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM |
+        GST_PAD_PROBE_TYPE_PULL, mock_fence_query_cb, &c, NULL);
+    gst_object_unref (pad);
+    /* Past the queue, so that the vpe threads are not the ones waiting */
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "kmssink");
+    pad = gst_element_get_static_pad (sink, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, mock_fence_buffer_cb,
+        &c, NULL);
+    gst_object_unref (pad);
+    gst_object_unref (sink);
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    start = g_get_monotonic_time ();
+    while (!sigtermed &&
+        g_get_monotonic_time () - start < seconds * G_USEC_PER_SEC)
+      usleep (10000);
+    early = 0;
+    g_object_get (vpe, "stats", &stats, NULL);
+    if (stats) {
+      gst_structure_get_uint64 (stats, "early-frames", &early);
+      gst_structure_free (stats);
+    }
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (vpe);
+    gst_object_unref (pipeline);
+
+    printf ("%s consumer: %u frames, %" G_GUINT64_FORMAT " pushed ahead, "
+        "%u with a fence, %u not signalled at push, %u timeouts\n",
+        c.advertise ? "fence aware" : "plain", c.frames, early, c.fenced,
+        c.unsignalled, c.timeouts);
+    if (c.unsignalled)
+      printf ("  fence wait: avg %" G_GINT64_FORMAT " us, max %"
+          G_GINT64_FORMAT " us\n", c.wait_total / c.unsignalled, c.wait_max);
+    if (!c.advertise && (early || c.fenced))
+      printf ("  ERROR: frames pushed ahead to a plain consumer\n");
+  }
+}
+
+/* Read the restart counters of the vpe stats */
+static void
+get_vpe_restarts (GstElement * vpe, guint64 * restarts, guint64 * cached)
+{
+  GstStructure *stats = NULL;
+
+  *restarts = *cached = 0;
+  g_object_get (vpe, "stats", &stats, NULL);
+  if (stats) {
+    gst_structure_get_uint64 (stats, "restarts", restarts);
+    gst_structure_get_uint64 (stats, "cached-restarts", cached);
+    gst_structure_free (stats);
+  }
+}
+
+/* Flush seek a playing pipeline count times with the same caps, then count
+ * times into and out of a downscaled trick mode, so that the caps change
+ * on every restart. Print how long each kind takes to the first frame and
+ * how many restarts reused the driver setup: all of the first kind, none
+ * of the second.
+ */
+static void
+bench_restart (int count, char *arg)
+{
+  static const char *names[2] = { "same caps", "different caps" };
+  GstElement *pipeline, *vpe;
+  guint64 restarts[2], cached[2], r0, c0;
+  gint64 start, total[2] = { 0, 0 };
+  int frames[2] = { 0, 0 }, i, k;
+
+  pipeline = play_to_first_frame (arg, "async-teardown", TRUE, NULL);
+  if (!pipeline)
+    return;
+  vpe = gst_bin_get_by_name (GST_BIN (pipeline), "vpe");
+  if (!vpe) {
+    printf ("No vpe in the pipeline\n");
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (pipeline);
+    return;
+  }
+  g_object_set (vpe, "trickmode-scale", 2, NULL);
+  for (k = 0; k < 2; k++) {
+    get_vpe_restarts (vpe, &r0, &c0);
+    for (i = 0; i < count && !sigtermed; i++) {
+      start = g_get_monotonic_time ();
+      /* Every other seek leaves the trick mode again */
+      if (seek_to_first_frame (pipeline, k && !(i % 2) ? 2.0 : 1.0, k &&
+              !(i % 2) ? GST_SEEK_FLAG_TRICKMODE : GST_SEEK_FLAG_NONE)) {
+        total[k] += g_get_monotonic_time () - start;
+        frames[k]++;
+      }
+    }
+    get_vpe_restarts (vpe, &restarts[k], &cached[k]);
+    restarts[k] -= r0;
+    cached[k] -= c0;
+  }
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (vpe);
+  gst_object_unref (pipeline);
+  for (k = 0; k < 2; k++) {
+    printf ("%s: %d seeks, %" G_GUINT64_FORMAT " restarts, %"
+        G_GUINT64_FORMAT " cached", names[k], frames[k], restarts[k],
+        cached[k]);
+    if (frames[k])
+      printf (", seek to first frame avg %" G_GINT64_FORMAT " us",
+          total[k] / frames[k]);
+    printf ("\n");
+  }
+  if (cached[0] != restarts[0] || cached[1] != 0)
+    printf ("ERROR: restarts reused the driver setup %s\n",
+        cached[1] ? "with different caps" : "only in part with the same caps");
+}
+
 gint
 main (gint argc, gchar * argv[])
 {
@@ -283,6 +824,28 @@ main (gint argc, gchar * argv[])
       i = atoi (args[1]);
       printf ("Starting pipeline %d\n", i);
       p[i] = create_pipeline (args[2]);
+      printf ("Set Play Mode ...\r\n");
+      gst_element_set_state (p[i], GST_STATE_PLAYING);
+    }
+
+    else if (3 == n && 0 == strcmp ("bench", args[0])) {
+      bench_start (atoi (args[1]), args[2]);
+    }
+
+    else if (3 == n && 0 == strcmp ("switch", args[0])) {
+      bench_switch (atoi (args[1]), args[2]);
+    }
+
+    else if (2 == n && 0 == strcmp ("trick", args[0])) {
+      bench_trick (args[1]);
+    } else if (3 == n && 0 == strcmp ("restart", args[0])) {
+      bench_restart (atoi (args[1]), args[2]);
+    }
+
+    else if (3 == n && 0 == strcmp ("contention", args[0])) {
+      bench_contention (atoi (args[1]), args[2]);
+    } else if (3 == n && 0 == strcmp ("fences", args[0])) {
+      bench_fences (atoi (args[1]), args[2]);
     }
 
     else if (2 == n && 0 == strcmp ("stop", args[0])) {
@@ -366,6 +929,18 @@ main (gint argc, gchar * argv[])
       printf
           (" seek   <instance num> <seek to time in seconds> <optional: playback speed>\n");
       printf (" sleep   <sleep time in seconds>\n");
+      printf
+          (" bench  <count> <filename> <time start to first frame, count times>\n");
+      printf
+          (" switch <count> <filename> <time stop and switch to a new pipeline, count times>\n");
+      printf
+          (" trick  <filename> <check the output is downscaled in trick modes>\n");
+      printf
+          (" restart <count> <filename> <check flush seeks reuse the driver setup only with the same caps>\n");
+      printf
+          (" contention <seconds> <filename> <time waits on the vpe locks while playing and changing state>\n");
+      printf
+          (" fences <seconds> <filename> <push ahead only to a consumer that waits for the fences>\n");
       printf
           (" rewind <line number> <rewind command file go to line number>\n");
       printf (" exit\n");